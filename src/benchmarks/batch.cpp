@@ -0,0 +1,93 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2016 Mateusz Pusz
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include "shared_ptr_2.h"
+#include <benchmark/benchmark.h>
+#include <algorithm>
+#include <random>
+#include <vector>
+
+namespace {
+
+using ptr_type = experimental::shared_ptr<int>;
+
+// state.range(0) pointers to state.range(1) objects placed in random order
+std::vector<ptr_type> make_owners(const benchmark::State& state, std::vector<ptr_type>& objects)
+{
+  objects.clear();
+  for(int64_t i = 0; i < state.range(1); ++i) {
+    objects.push_back(experimental::make_shared<int>(0));
+  }
+  std::vector<ptr_type> owners;
+  owners.reserve(static_cast<std::size_t>(state.range(0)));
+  for(int64_t i = 0; i < state.range(0); ++i) {
+    owners.push_back(objects[static_cast<std::size_t>(i % state.range(1))]);
+  }
+  std::shuffle(owners.begin(), owners.end(), std::mt19937{42});
+  return owners;
+}
+
+// clear the range one pointer at a time
+void teardown_clear(benchmark::State& state)
+{
+  std::vector<ptr_type> objects;
+  for(auto _ : state) {
+    state.PauseTiming();
+    auto owners = make_owners(state, objects);
+    state.ResumeTiming();
+    owners.clear();
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+// release runs of consecutive pointers sharing an object
+void teardown_release_n(benchmark::State& state)
+{
+  std::vector<ptr_type> objects;
+  for(auto _ : state) {
+    state.PauseTiming();
+    auto owners = make_owners(state, objects);
+    state.ResumeTiming();
+    experimental::release_n(owners.begin(), owners.end());
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+// release every object once
+void teardown_release_all(benchmark::State& state)
+{
+  std::vector<ptr_type> objects;
+  for(auto _ : state) {
+    state.PauseTiming();
+    auto owners = make_owners(state, objects);
+    state.ResumeTiming();
+    experimental::release_all(owners.begin(), owners.end());
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+}  // namespace
+
+BENCHMARK(teardown_clear)->Args({1 << 16, 1 << 4})->Args({1 << 16, 1 << 12})->Args({1 << 16, 1 << 16});
+BENCHMARK(teardown_release_n)->Args({1 << 16, 1 << 4})->Args({1 << 16, 1 << 12})->Args({1 << 16, 1 << 16});
+BENCHMARK(teardown_release_all)->Args({1 << 16, 1 << 4})->Args({1 << 16, 1 << 12})->Args({1 << 16, 1 << 16});
@@ -0,0 +1,201 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2016 Mateusz Pusz
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include "shared_ptr_2.h"
+#include <benchmark/benchmark.h>
+#include <memory>
+#ifdef SHARED_PTR_2_BENCHMARK_BOOST
+#include <boost/make_shared.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
+#endif
+
+namespace {
+
+// Implementations compared side by side
+struct experimental_ptr {
+  template<typename T>
+  using shared_ptr = experimental::shared_ptr<T>;
+  template<typename T>
+  using weak_ptr = experimental::weak_ptr<T>;
+
+  template<typename T, typename... Args>
+  static shared_ptr<T> make_shared(Args&&... args)
+  {
+    return experimental::make_shared<T>(std::forward<Args>(args)...);
+  }
+};
+
+struct std_ptr {
+  template<typename T>
+  using shared_ptr = std::shared_ptr<T>;
+  template<typename T>
+  using weak_ptr = std::weak_ptr<T>;
+
+  template<typename T, typename... Args>
+  static shared_ptr<T> make_shared(Args&&... args)
+  {
+    return std::make_shared<T>(std::forward<Args>(args)...);
+  }
+};
+
+#ifdef SHARED_PTR_2_BENCHMARK_BOOST
+struct boost_ptr {
+  template<typename T>
+  using shared_ptr = boost::shared_ptr<T>;
+  template<typename T>
+  using weak_ptr = boost::weak_ptr<T>;
+
+  template<typename T, typename... Args>
+  static shared_ptr<T> make_shared(Args&&... args)
+  {
+    return boost::make_shared<T>(std::forward<Args>(args)...);
+  }
+};
+#endif
+
+struct object {
+  int value = 0;
+};
+
+// control block shared by all the threads of a benchmark
+template<typename Ptr>
+typename Ptr::template shared_ptr<object> shared_object;
+
+template<typename Ptr>
+typename Ptr::template weak_ptr<object> weak_object;
+
+template<typename Ptr>
+void setup_shared_object(const benchmark::State& state)
+{
+  if(state.thread_index() == 0) {
+    shared_object<Ptr> = Ptr::template make_shared<object>();
+    weak_object<Ptr> = shared_object<Ptr>;
+  }
+}
+
+template<typename Ptr>
+void teardown_shared_object(const benchmark::State& state)
+{
+  if(state.thread_index() == 0) {
+    shared_object<Ptr> = nullptr;
+    weak_object<Ptr> = typename Ptr::template weak_ptr<object>{};
+  }
+}
+
+// adopt a raw pointer and destroy the owner
+template<typename Ptr>
+void construct_from_ptr(benchmark::State& state)
+{
+  for(auto _ : state) {
+    typename Ptr::template shared_ptr<object> p{new object};
+    benchmark::DoNotOptimize(p);
+  }
+}
+
+template<typename Ptr>
+void make_shared(benchmark::State& state)
+{
+  for(auto _ : state) {
+    auto p = Ptr::template make_shared<object>();
+    benchmark::DoNotOptimize(p);
+  }
+}
+
+template<typename Ptr>
+void construct_from_unique_ptr(benchmark::State& state)
+{
+  for(auto _ : state) {
+    typename Ptr::template shared_ptr<object> p{std::unique_ptr<object>{new object}};
+    benchmark::DoNotOptimize(p);
+  }
+}
+
+template<typename Ptr>
+void copy(benchmark::State& state)
+{
+  setup_shared_object<Ptr>(state);
+  for(auto _ : state) {
+    typename Ptr::template shared_ptr<object> p{shared_object<Ptr>};
+    benchmark::DoNotOptimize(p);
+  }
+  teardown_shared_object<Ptr>(state);
+}
+
+// move a private owner back and forth, which never touches the counters
+template<typename Ptr>
+void move(benchmark::State& state)
+{
+  typename Ptr::template shared_ptr<object> p = Ptr::template make_shared<object>();
+  for(auto _ : state) {
+    typename Ptr::template shared_ptr<object> tmp{std::move(p)};
+    p = std::move(tmp);
+    benchmark::DoNotOptimize(p);
+  }
+}
+
+template<typename Ptr>
+void aliasing(benchmark::State& state)
+{
+  setup_shared_object<Ptr>(state);
+  for(auto _ : state) {
+    typename Ptr::template shared_ptr<int> p{shared_object<Ptr>, &shared_object<Ptr>->value};
+    benchmark::DoNotOptimize(p);
+  }
+  teardown_shared_object<Ptr>(state);
+}
+
+template<typename Ptr>
+void weak_lock(benchmark::State& state)
+{
+  setup_shared_object<Ptr>(state);
+  for(auto _ : state) {
+    auto p = weak_object<Ptr>.lock();
+    benchmark::DoNotOptimize(p);
+  }
+  teardown_shared_object<Ptr>(state);
+}
+
+}  // namespace
+
+// every case runs single-threaded and with up to 64 threads sharing one control block
+#define SHARED_PTR_BENCHMARK(func, ptr) BENCHMARK_TEMPLATE(func, ptr)->ThreadRange(1, 64)->UseRealTime()
+
+#ifdef SHARED_PTR_2_BENCHMARK_BOOST
+#define SHARED_PTR_BENCHMARKS(func)           \
+  SHARED_PTR_BENCHMARK(func, experimental_ptr); \
+  SHARED_PTR_BENCHMARK(func, std_ptr);          \
+  SHARED_PTR_BENCHMARK(func, boost_ptr)
+#else
+#define SHARED_PTR_BENCHMARKS(func)           \
+  SHARED_PTR_BENCHMARK(func, experimental_ptr); \
+  SHARED_PTR_BENCHMARK(func, std_ptr)
+#endif
+
+SHARED_PTR_BENCHMARKS(construct_from_ptr);
+SHARED_PTR_BENCHMARKS(make_shared);
+SHARED_PTR_BENCHMARKS(construct_from_unique_ptr);
+SHARED_PTR_BENCHMARKS(copy);
+SHARED_PTR_BENCHMARKS(move);
+SHARED_PTR_BENCHMARKS(aliasing);
+SHARED_PTR_BENCHMARKS(weak_lock);
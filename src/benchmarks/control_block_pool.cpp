@@ -0,0 +1,71 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2016 Mateusz Pusz
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "shared_ptr_2.h"
+#include "control_block_pool.h"
+#include <benchmark/benchmark.h>
+#include <thread>
+#include <vector>
+
+namespace {
+
+struct buffer {
+  char data[64];
+};
+
+// adopts an externally allocated buffer and releases it right away
+template<typename Alloc>
+void adopt(benchmark::State& state)
+{
+  buffer* b = new buffer;
+  for(auto _ : state) {
+    experimental::shared_ptr<buffer> p{b, [](buffer*) {}, Alloc{}};
+    benchmark::DoNotOptimize(p);
+  }
+  delete b;
+}
+
+// adopts buffers on one thread and releases them on another one
+template<typename Alloc>
+void adopt_release_elsewhere(benchmark::State& state)
+{
+  const auto batch = static_cast<std::size_t>(state.range(0));
+  buffer* b = new buffer;
+  std::vector<experimental::shared_ptr<buffer>> ptrs;
+  ptrs.reserve(batch);
+  for(auto _ : state) {
+    for(std::size_t i = 0; i < batch; ++i) {
+      ptrs.emplace_back(b, [](buffer*) {}, Alloc{});
+    }
+    std::thread{[&] { ptrs.clear(); }}.join();
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+  delete b;
+}
+
+}  // namespace
+
+BENCHMARK_TEMPLATE(adopt, std::allocator<buffer>)->ThreadRange(1, 8)->UseRealTime();
+BENCHMARK_TEMPLATE(adopt, experimental::pool_allocator<buffer>)->ThreadRange(1, 8)->UseRealTime();
+
+BENCHMARK_TEMPLATE(adopt_release_elsewhere, std::allocator<buffer>)->Arg(4096);
+BENCHMARK_TEMPLATE(adopt_release_elsewhere, experimental::pool_allocator<buffer>)->Arg(4096);
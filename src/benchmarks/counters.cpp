@@ -0,0 +1,148 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2016 Mateusz Pusz
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "shared_ptr_2.h"
+#include <benchmark/benchmark.h>
+
+namespace {
+
+// Counters with sequentially consistent operations and no fast paths used as a reference point
+class seq_cst_counters {
+  std::atomic_int shared_counter_{1};
+  std::atomic_int weak_counter_{1};
+
+public:
+  void add_shared(int count = 1) noexcept { shared_counter_ += count; }
+  experimental::release_result release_shared() noexcept
+  {
+    return --shared_counter_ == 0 ? experimental::release_result::last_shared : experimental::release_result::none;
+  }
+  bool try_add_shared() noexcept
+  {
+    int count = shared_counter_.load();
+    while(count != 0) {
+      if(shared_counter_.compare_exchange_weak(count, count + 1)) {
+        return true;
+      }
+    }
+    return false;
+  }
+  void add_weak() noexcept { ++weak_counter_; }
+  bool release_weak() noexcept { return --weak_counter_ == 0; }
+  long use_count() const noexcept { return shared_counter_.load(); }
+};
+
+template<typename Counters>
+experimental::shared_ptr<int, Counters> shared_object;
+
+template<typename Counters>
+experimental::weak_ptr<int, Counters> weak_object;
+
+// copy and destroy a pointer to an object owned by other threads too
+template<typename Counters>
+void copy(benchmark::State& state)
+{
+  if(state.thread_index() == 0) {
+    shared_object<Counters> = experimental::make_shared_with<int, Counters>(0);
+  }
+  for(auto _ : state) {
+    experimental::shared_ptr<int, Counters> copy{shared_object<Counters>};
+    benchmark::DoNotOptimize(copy);
+  }
+  if(state.thread_index() == 0) {
+    shared_object<Counters> = nullptr;
+  }
+}
+
+// create and destroy an object that never gets a second owner
+template<typename Counters>
+void unique_owner(benchmark::State& state)
+{
+  for(auto _ : state) {
+    auto ptr = experimental::make_shared_with<int, Counters>(0);
+    benchmark::DoNotOptimize(ptr);
+  }
+}
+
+// release the last owner of an object observed by a weak_ptr
+template<typename Counters>
+void unique_owner_with_weak(benchmark::State& state)
+{
+  for(auto _ : state) {
+    auto ptr = experimental::make_shared_with<int, Counters>(0);
+    experimental::weak_ptr<int, Counters> weak{ptr};
+    benchmark::DoNotOptimize(weak);
+  }
+}
+
+// promote a weak_ptr while the last owner goes away in the middle of the run
+template<typename Counters>
+void weak_lock(benchmark::State& state)
+{
+  if(state.thread_index() == 0) {
+    shared_object<Counters> = experimental::make_shared_with<int, Counters>(0);
+    weak_object<Counters> = shared_object<Counters>;
+  }
+  const auto drop_at = state.max_iterations / 2;
+  benchmark::IterationCount i = 0;
+  for(auto _ : state) {
+    auto ptr = weak_object<Counters>.lock();
+    benchmark::DoNotOptimize(ptr);
+    if(state.thread_index() == 0 && ++i == drop_at) {
+      shared_object<Counters> = nullptr;
+    }
+  }
+  if(state.thread_index() == 0) {
+    shared_object<Counters> = nullptr;
+    weak_object<Counters> = experimental::weak_ptr<int, Counters>{};
+  }
+}
+
+}  // namespace
+
+BENCHMARK_TEMPLATE(copy, seq_cst_counters)->ThreadRange(1, 8)->UseRealTime();
+BENCHMARK_TEMPLATE(copy, experimental::atomic_counters)->ThreadRange(1, 8)->UseRealTime();
+BENCHMARK_TEMPLATE(copy, experimental::packed_counters)->ThreadRange(1, 8)->UseRealTime();
+BENCHMARK_TEMPLATE(copy, experimental::biased_counters)->ThreadRange(1, 8)->UseRealTime();
+BENCHMARK_TEMPLATE(copy, experimental::sharded_counters<>)->ThreadRange(1, 8)->UseRealTime();
+BENCHMARK_TEMPLATE(copy, experimental::local_counters);
+
+BENCHMARK_TEMPLATE(unique_owner, seq_cst_counters);
+BENCHMARK_TEMPLATE(unique_owner, experimental::atomic_counters);
+BENCHMARK_TEMPLATE(unique_owner, experimental::packed_counters);
+BENCHMARK_TEMPLATE(unique_owner, experimental::biased_counters);
+BENCHMARK_TEMPLATE(unique_owner, experimental::sharded_counters<>);
+BENCHMARK_TEMPLATE(unique_owner, experimental::local_counters);
+
+BENCHMARK_TEMPLATE(unique_owner_with_weak, seq_cst_counters);
+BENCHMARK_TEMPLATE(unique_owner_with_weak, experimental::atomic_counters);
+BENCHMARK_TEMPLATE(unique_owner_with_weak, experimental::packed_counters);
+BENCHMARK_TEMPLATE(unique_owner_with_weak, experimental::biased_counters);
+BENCHMARK_TEMPLATE(unique_owner_with_weak, experimental::sharded_counters<>);
+BENCHMARK_TEMPLATE(unique_owner_with_weak, experimental::local_counters);
+
+BENCHMARK_TEMPLATE(weak_lock, seq_cst_counters)->ThreadRange(1, 8)->UseRealTime();
+BENCHMARK_TEMPLATE(weak_lock, experimental::atomic_counters)->ThreadRange(1, 8)->UseRealTime();
+BENCHMARK_TEMPLATE(weak_lock, experimental::packed_counters)->ThreadRange(1, 8)->UseRealTime();
+BENCHMARK_TEMPLATE(weak_lock, experimental::biased_counters)->ThreadRange(1, 8)->UseRealTime();
+BENCHMARK_TEMPLATE(weak_lock, experimental::sharded_counters<>)->ThreadRange(1, 8)->UseRealTime();
+BENCHMARK_TEMPLATE(weak_lock, experimental::local_counters);
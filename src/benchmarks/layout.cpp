@@ -0,0 +1,64 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2016 Mateusz Pusz
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include "shared_ptr_2.h"
+#include <benchmark/benchmark.h>
+
+namespace {
+
+// small object updated all the time by one thread
+struct hot_object {
+  int counter = 0;
+  int data[7] = {};
+};
+
+template<typename Counters>
+experimental::shared_ptr<hot_object, Counters> shared_hot_object;
+
+// thread 0 keeps writing to the object while the others copy the pointer to it
+template<typename Counters>
+void write_while_copying(benchmark::State& state)
+{
+  if(state.thread_index() == 0) {
+    shared_hot_object<Counters> = experimental::make_shared_with<hot_object, Counters>();
+  }
+  for(auto _ : state) {
+    if(state.thread_index() == 0) {
+      hot_object* object = shared_hot_object<Counters>.get();
+      benchmark::DoNotOptimize(++object->counter);
+      benchmark::ClobberMemory();
+    }
+    else {
+      experimental::shared_ptr<hot_object, Counters> copy{shared_hot_object<Counters>};
+      benchmark::DoNotOptimize(copy);
+    }
+  }
+  if(state.thread_index() == 0) {
+    shared_hot_object<Counters> = nullptr;
+  }
+}
+
+}  // namespace
+
+BENCHMARK_TEMPLATE(write_while_copying, experimental::atomic_counters)->ThreadRange(2, 8)->UseRealTime();
+BENCHMARK_TEMPLATE(write_while_copying, experimental::padded_counters<>)->ThreadRange(2, 8)->UseRealTime();
@@ -0,0 +1,81 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2016 Mateusz Pusz
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include "relocation.h"
+#include <benchmark/benchmark.h>
+#include <vector>
+
+namespace {
+
+using ptr_type = experimental::shared_ptr<int>;
+
+constexpr std::size_t element_count = 10'000'000;
+constexpr int erase_count = 16;
+
+// grow a vector to 10M pointers without reserving the memory up front
+template<typename Vector>
+void grow(benchmark::State& state)
+{
+  const auto object = experimental::make_shared<int>(0);
+  for(auto _ : state) {
+    Vector v;
+    for(std::size_t i = 0; i < element_count; ++i) {
+      v.push_back(object);
+    }
+    benchmark::DoNotOptimize(v.data());
+    state.PauseTiming();
+    v.clear();
+    state.ResumeTiming();
+  }
+}
+
+// erase elements from the front of a vector of 10M pointers
+template<typename Vector>
+void erase_front(benchmark::State& state)
+{
+  const auto object = experimental::make_shared<int>(0);
+  for(auto _ : state) {
+    state.PauseTiming();
+    Vector v;
+    v.reserve(element_count);
+    for(std::size_t i = 0; i < element_count; ++i) {
+      v.push_back(object);
+    }
+    state.ResumeTiming();
+    for(int i = 0; i < erase_count; ++i) {
+      v.erase(v.begin());
+    }
+    benchmark::DoNotOptimize(v.data());
+    state.PauseTiming();
+    v.clear();
+    state.ResumeTiming();
+  }
+}
+
+}  // namespace
+
+BENCHMARK_TEMPLATE(grow, std::vector<ptr_type>)->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(grow, experimental::relocating_vector<ptr_type>)->Unit(benchmark::kMillisecond);
+
+BENCHMARK_TEMPLATE(erase_front, std::vector<ptr_type>)->Unit(benchmark::kMillisecond);
+BENCHMARK_TEMPLATE(erase_front, experimental::relocating_vector<ptr_type>)->Unit(benchmark::kMillisecond);
@@ -0,0 +1,57 @@
+// The MIT License (MIT)
+//
+// Copyright (c) 2016 Mateusz Pusz
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include "shared_snapshot.h"
+#include <benchmark/benchmark.h>
+
+namespace {
+
+struct table {
+  int entries[16] = {};
+};
+
+experimental::shared_ptr<const table> published = experimental::make_shared<const table>();
+experimental::shared_snapshot<table> snapshot{published};
+
+// copy the published pointer for every read
+void read_shared_ptr(benchmark::State& state)
+{
+  for(auto _ : state) {
+    experimental::shared_ptr<const table> copy{published};
+    benchmark::DoNotOptimize(copy->entries[0]);
+  }
+}
+
+// open a read section for every read
+void read_snapshot(benchmark::State& state)
+{
+  for(auto _ : state) {
+    auto guard = snapshot.read();
+    benchmark::DoNotOptimize(guard->entries[0]);
+  }
+}
+
+}  // namespace
+
+BENCHMARK(read_shared_ptr)->ThreadRange(1, 8)->UseRealTime();
+BENCHMARK(read_snapshot)->ThreadRange(1, 8)->UseRealTime();
@@ -0,0 +1,241 @@
+#pragma once
+
+#include <cstddef>
+#include <mutex>
+#include <new>
+
+namespace experimental {
+
+namespace detail {
+
+// Thread-caching pool for small blocks like shared_ptr control blocks
+//
+// Every thread keeps a free list per size class. Blocks freed by a thread go to its own lists no
+// matter which thread allocated them. When a list grows too long a batch of blocks is moved to a
+// central list shared by all threads, and a thread with an empty list takes a whole batch from there
+// before carving a new slab. That way blocks allocated by a producer and freed by a consumer thread
+// travel back to the producer in batches and the mutex of the central list is taken once per batch.
+// Batches in the central list are chained through their first blocks so freeing a block never allocates.
+//
+// Memory of the pool is never returned to the system.
+class block_pool {
+public:
+  static constexpr std::size_t granularity = 16;
+  static constexpr std::size_t class_count = 8;  // blocks up to 128 bytes
+  static constexpr std::size_t batch_size = 32;
+
+  static bool pooled(std::size_t size, std::size_t alignment) noexcept
+  {
+    return size <= granularity * class_count && alignment <= granularity && granularity <= alignof(std::max_align_t);
+  }
+
+  static void* allocate(std::size_t size, std::size_t alignment)
+  {
+    if(!pooled(size, alignment)) {
+      return ::operator new(size);
+    }
+    if(thread_cache::destroyed()) {
+      // the thread is exiting and its cache is already gone
+      return allocate_uncached(size_class(size));
+    }
+    return cache().allocate(size_class(size));
+  }
+
+  static void deallocate(void* ptr, std::size_t size, std::size_t alignment) noexcept
+  {
+    if(!pooled(size, alignment)) {
+      ::operator delete(ptr);
+    }
+    else if(thread_cache::destroyed()) {
+      // the thread is exiting and its cache is already gone
+      central(size_class(size)).push({::new(ptr) free_block{}, 1});
+    }
+    else {
+      cache().deallocate(ptr, size_class(size));
+    }
+  }
+
+private:
+  struct free_block {
+    free_block* next = nullptr;
+    free_block* next_batch = nullptr;  // used only by the first block of a batch in the central list
+  };
+  static_assert(sizeof(free_block) <= granularity, "the smallest block has to hold the batch links");
+
+  struct block_list {
+    free_block* head = nullptr;
+    std::size_t count = 0;
+  };
+
+  static constexpr std::size_t size_class(std::size_t size) noexcept
+  {
+    return size ? (size - 1) / granularity : 0;
+  }
+  static constexpr std::size_t block_size(std::size_t cls) noexcept { return (cls + 1) * granularity; }
+
+  class central_list {
+    std::mutex mutex_;
+    free_block* batches_ = nullptr;
+
+  public:
+    void push(block_list batch) noexcept
+    {
+      std::lock_guard<std::mutex> lock{mutex_};
+      batch.head->next_batch = batches_;
+      batches_ = batch.head;
+    }
+
+    block_list pop() noexcept
+    {
+      block_list batch;
+      {
+        std::lock_guard<std::mutex> lock{mutex_};
+        batch.head = batches_;
+        if(batch.head) {
+          batches_ = batch.head->next_batch;
+        }
+      }
+      // the blocks are about to be handed out so counting them outside of the lock costs little
+      for(free_block* block = batch.head; block; block = block->next) {
+        ++batch.count;
+      }
+      return batch;
+    }
+  };
+
+  // never destroyed so that blocks can still be freed during static destruction
+  static central_list& central(std::size_t cls)
+  {
+    static central_list* lists = new central_list[class_count];
+    return lists[cls];
+  }
+
+  // takes a single block from the central list without a thread cache to keep the rest of its batch
+  static void* allocate_uncached(std::size_t cls)
+  {
+    block_list batch = central(cls).pop();
+    if(!batch.head) {
+      return ::operator new(block_size(cls));
+    }
+    free_block* block = batch.head;
+    if(block->next) {
+      central(cls).push({block->next, batch.count - 1});
+    }
+    return block;
+  }
+
+  class thread_cache {
+    block_list lists_[class_count];
+
+    static bool& destroyed_flag() noexcept
+    {
+      static thread_local bool flag = false;
+      return flag;
+    }
+
+    static block_list take(block_list& list, std::size_t count) noexcept
+    {
+      block_list batch{list.head, 0};
+      free_block* last = nullptr;
+      while(batch.count < count && list.head) {
+        last = list.head;
+        list.head = list.head->next;
+        ++batch.count;
+      }
+      if(last) {
+        last->next = nullptr;
+      }
+      list.count -= batch.count;
+      return batch;
+    }
+
+    static block_list carve(std::size_t cls)
+    {
+      const std::size_t size = block_size(cls);
+      char* slab = static_cast<char*>(::operator new(size * batch_size));
+      block_list batch{nullptr, batch_size};
+      for(std::size_t i = batch_size; i-- > 0;) {
+        batch.head = ::new(slab + i * size) free_block{batch.head};
+      }
+      return batch;
+    }
+
+  public:
+    thread_cache() = default;
+    thread_cache(const thread_cache&) = delete;
+    thread_cache& operator=(const thread_cache&) = delete;
+    ~thread_cache()
+    {
+      for(std::size_t cls = 0; cls < class_count; ++cls) {
+        if(lists_[cls].head) {
+          central(cls).push(lists_[cls]);
+        }
+      }
+      destroyed_flag() = true;
+    }
+
+    static bool destroyed() noexcept { return destroyed_flag(); }
+
+    void* allocate(std::size_t cls)
+    {
+      block_list& list = lists_[cls];
+      if(!list.head) {
+        list = central(cls).pop();
+        if(!list.head) {
+          list = carve(cls);
+        }
+      }
+      free_block* block = list.head;
+      list.head = block->next;
+      --list.count;
+      return block;
+    }
+
+    void deallocate(void* ptr, std::size_t cls) noexcept
+    {
+      block_list& list = lists_[cls];
+      list.head = ::new(ptr) free_block{list.head};
+      if(++list.count >= 2 * batch_size) {
+        central(cls).push(take(list, batch_size));
+      }
+    }
+  };
+
+  static thread_cache& cache()
+  {
+    static thread_local thread_cache c;
+    return c;
+  }
+};
+
+}  // namespace detail
+
+// Allocator that takes memory from the thread-caching control block pool
+template<typename T>
+class pool_allocator {
+public:
+  using value_type = T;
+
+  pool_allocator() = default;
+  template<typename U>
+  pool_allocator(const pool_allocator<U>&) noexcept
+  {
+  }
+
+  T* allocate(std::size_t n) { return static_cast<T*>(detail::block_pool::allocate(n * sizeof(T), alignof(T))); }
+  void deallocate(T* ptr, std::size_t n) noexcept { detail::block_pool::deallocate(ptr, n * sizeof(T), alignof(T)); }
+};
+
+template<typename T, typename U>
+bool operator==(const pool_allocator<T>&, const pool_allocator<U>&) noexcept
+{
+  return true;
+}
+
+template<typename T, typename U>
+bool operator!=(const pool_allocator<T>&, const pool_allocator<U>&) noexcept
+{
+  return false;
+}
+
+}  // namespace experimental
@@ -0,0 +1,230 @@
+#pragma once
+
+#include "shared_ptr_2.h"
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <thread>
+
+namespace experimental {
+
+namespace detail {
+
+// Intrusive link of a control block waiting in a reclamation_queue
+struct deferred_node {
+  deferred_node* next;
+  void (*reclaim)(deferred_node&) noexcept;
+};
+
+}  // namespace detail
+
+// Lock-free multi-producer queue of control blocks whose objects still have to be deleted
+//
+// Pushing is a single CAS on the hot path. drain() takes the whole list at once and reclaims the blocks
+// in the order they were pushed, including the ones pushed by the deleters run in the meantime.
+class reclamation_queue {
+  std::atomic<detail::deferred_node*> head_{nullptr};
+
+public:
+  reclamation_queue() = default;
+  reclamation_queue(const reclamation_queue&) = delete;
+  reclamation_queue& operator=(const reclamation_queue&) = delete;
+  ~reclamation_queue() { drain(); }
+
+  void push(detail::deferred_node& node) noexcept
+  {
+    node.next = head_.load(std::memory_order_relaxed);
+    while(!head_.compare_exchange_weak(node.next, &node, std::memory_order_release, std::memory_order_relaxed)) {
+    }
+  }
+
+  // returns the number of reclaimed control blocks
+  std::size_t drain() noexcept
+  {
+    std::size_t count = 0;
+    while(detail::deferred_node* list = head_.exchange(nullptr, std::memory_order_acquire)) {
+      detail::deferred_node* fifo = nullptr;
+      while(list) {
+        detail::deferred_node* next = list->next;
+        list->next = fifo;
+        fifo = list;
+        list = next;
+      }
+      while(fifo) {
+        detail::deferred_node* next = fifo->next;
+        fifo->reclaim(*fifo);
+        fifo = next;
+        ++count;
+      }
+    }
+    return count;
+  }
+
+  bool empty() const noexcept { return head_.load(std::memory_order_relaxed) == nullptr; }
+};
+
+// Queue used by deferred deleters created without an explicit one
+//
+// It is never destroyed so that releases during static destruction can still push to it. The blocks
+// pushed before the static destruction reaches the first use of the queue are drained at that point,
+// later ones are not reclaimed.
+inline reclamation_queue& default_reclamation_queue()
+{
+  static reclamation_queue* queue = new reclamation_queue;
+  static struct drainer {
+    ~drainer() { queue->drain(); }
+  } drain_at_exit;
+  return *queue;
+}
+
+// Deleter wrapper that moves the deletion of the managed object off the thread dropping the last reference
+//
+// Instead of calling D the last release pushes the control block to a reclamation_queue. The object is
+// deleted (and the control block destroyed) by the thread that drains that queue. weak_ptr observers see
+// the object as expired right away. With local_counters the queue has to be drained by the owning thread.
+template<typename D>
+class deferred_deleter {
+  D deleter_;
+  reclamation_queue* queue_;
+
+public:
+  explicit deferred_deleter(D d = D{}, reclamation_queue& queue = default_reclamation_queue())
+      : deleter_{std::move(d)}, queue_{&queue}
+  {
+  }
+
+  // deletes synchronously, used only if the shared ownership could not be established
+  template<typename Ptr>
+  void operator()(Ptr p) noexcept
+  {
+    deleter_(p);
+  }
+
+  D& deleter() noexcept { return deleter_; }
+  reclamation_queue& queue() const noexcept { return *queue_; }
+};
+
+template<typename D>
+deferred_deleter<std::decay_t<D>> defer_deletion(D&& d, reclamation_queue& queue = default_reclamation_queue())
+{
+  return deferred_deleter<std::decay_t<D>>{std::forward<D>(d), queue};
+}
+
+template<typename T>
+deferred_deleter<std::default_delete<T>> defer_deletion(reclamation_queue& queue = default_reclamation_queue())
+{
+  return deferred_deleter<std::default_delete<T>>{std::default_delete<T>{}, queue};
+}
+
+// Thread periodically draining a reclamation_queue
+class reclaimer_thread {
+  reclamation_queue& queue_;
+  std::atomic<bool> stop_{false};
+  std::thread thread_;
+
+public:
+  explicit reclaimer_thread(reclamation_queue& queue = default_reclamation_queue(),
+                            std::chrono::microseconds period = std::chrono::milliseconds{1})
+      : queue_{queue}, thread_{[this, period] {
+          while(!stop_.load(std::memory_order_relaxed)) {
+            if(queue_.drain() == 0) {
+              std::this_thread::sleep_for(period);
+            }
+          }
+        }}
+  {
+  }
+  reclaimer_thread(const reclaimer_thread&) = delete;
+  reclaimer_thread& operator=(const reclaimer_thread&) = delete;
+  ~reclaimer_thread()
+  {
+    stop_.store(true, std::memory_order_relaxed);
+    thread_.join();
+    queue_.drain();
+  }
+};
+
+namespace detail {
+
+// Control block of a pointer adopted with a deferred_deleter
+//
+// The last release pushes the block to the queue. If weak references may still exist the queue holds a
+// weak reference of its own so the block stays alive until it is reclaimed, so that release costs a push,
+// an add_weak and the weak_release that follows. Only the release of the last reference of any kind is a
+// single push.
+template<typename Counters, typename Ptr, typename D, typename A>
+class deferred_state final : public state_base<Counters>,
+                             private deferred_node,
+                             private ebo_helper<deferred_deleter<D>, 0>,
+                             private ebo_helper<A, 1> {
+  using DBase = ebo_helper<deferred_deleter<D>, 0>;
+  using ABase = ebo_helper<A, 1>;
+  Ptr ptr_;
+  bool destroy_ = false;  // no weak references are left so the block is destroyed right after the object
+  deferred_deleter<D>& deleter() { return static_cast<DBase&>(*this).get(); }
+  A& allocator() { return static_cast<ABase&>(*this).get(); }
+
+  static void release_ptr(state_base<Counters>& base) noexcept
+  {
+    deferred_state& self = static_cast<deferred_state&>(base);
+    self.add_weak();
+    self.destroy_ = false;
+    self.deleter().queue().push(self);
+  }
+  static void destroy(state_base<Counters>& base) noexcept
+  {
+    deferred_state& self = static_cast<deferred_state&>(base);
+    allocator_type alloc{self.allocator()};
+    using alloc_traits = std::allocator_traits<allocator_type>;
+    alloc_guard<allocator_type> guard{alloc, &self};
+    alloc_traits::destroy(alloc, &self);
+  }
+  static void release_ptr_and_destroy(state_base<Counters>& base) noexcept
+  {
+    deferred_state& self = static_cast<deferred_state&>(base);
+    self.destroy_ = true;
+    self.deleter().queue().push(self);
+  }
+  static constexpr state_ops<Counters> ops{&release_ptr, &destroy, &release_ptr_and_destroy};
+
+  static void reclaim(deferred_node& node) noexcept
+  {
+    deferred_state& self = static_cast<deferred_state&>(node);
+    self.deleter().deleter()(self.ptr_);
+    if(self.destroy_) {
+      destroy(self);
+    }
+    else {
+      self.weak_release();
+    }
+  }
+
+public:
+  using allocator_type = typename std::allocator_traits<A>::template rebind_alloc<deferred_state>;
+  template<typename DD>
+  deferred_state(Ptr ptr, DD&& d) noexcept : deferred_state{ptr, std::forward<DD>(d), A{}}
+  {
+  }
+  template<typename DD, typename AA>
+  deferred_state(Ptr ptr, DD&& d, AA&& a) noexcept
+      : state_base<Counters>{&ops},
+        deferred_node{nullptr, &reclaim},
+        DBase{std::forward<DD>(d)},
+        ABase{std::forward<AA>(a)},
+        ptr_{ptr}
+  {
+    this->template track<Ptr>();
+  }
+};
+
+template<typename Counters, typename Ptr, typename D, typename A>
+constexpr state_ops<Counters> deferred_state<Counters, Ptr, D, A>::ops;
+
+template<typename Counters, typename Ptr, typename D, typename A>
+struct state_selector<Counters, Ptr, deferred_deleter<D>, A> {
+  using type = deferred_state<Counters, Ptr, D, A>;
+};
+
+}  // namespace detail
+
+}  // namespace experimental
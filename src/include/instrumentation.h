@@ -0,0 +1,130 @@
+#pragma once
+
+#include <atomic>
+
+// Instrumentation of reference counting traffic and control blocks
+//
+// Enabled by defining SHARED_PTR_2_INSTRUMENTATION for the whole program before shared_ptr_2.h is
+// included. Without it the hooks compile to nothing and this header is not used. Counts are global,
+// updated with relaxed atomics and meant for assertions on the difference of two snapshots:
+//
+//   auto before = experimental::instrumentation::take_snapshot();
+//   ...
+//   auto traffic = experimental::instrumentation::take_snapshot() - before;
+//   EXPECT_EQ(0, traffic.allocations);
+
+namespace experimental {
+
+namespace instrumentation {
+
+struct snapshot {
+  long shared_increments = 0;
+  long shared_decrements = 0;
+  long weak_increments = 0;
+  long weak_decrements = 0;
+  long allocations = 0;  // control blocks allocated (embedded ones do not count)
+  long live_states = 0;  // control blocks still alive
+};
+
+inline snapshot operator-(const snapshot& lhs, const snapshot& rhs) noexcept
+{
+  snapshot result;
+  result.shared_increments = lhs.shared_increments - rhs.shared_increments;
+  result.shared_decrements = lhs.shared_decrements - rhs.shared_decrements;
+  result.weak_increments = lhs.weak_increments - rhs.weak_increments;
+  result.weak_decrements = lhs.weak_decrements - rhs.weak_decrements;
+  result.allocations = lhs.allocations - rhs.allocations;
+  result.live_states = lhs.live_states - rhs.live_states;
+  return result;
+}
+
+namespace detail {
+
+struct totals {
+  std::atomic<long> shared_increments{0};
+  std::atomic<long> shared_decrements{0};
+  std::atomic<long> weak_increments{0};
+  std::atomic<long> weak_decrements{0};
+  std::atomic<long> allocations{0};
+  std::atomic<long> live_states{0};
+};
+
+inline totals& global_totals() noexcept
+{
+  static totals t;
+  return t;
+}
+
+// live control blocks managing a pointer of type Ptr
+template<typename Ptr>
+std::atomic<long>& live_states() noexcept
+{
+  static std::atomic<long> count{0};
+  return count;
+}
+
+inline void add(std::atomic<long>& counter, long value) noexcept
+{
+  counter.fetch_add(value, std::memory_order_relaxed);
+}
+
+}  // namespace detail
+
+inline snapshot take_snapshot() noexcept
+{
+  const detail::totals& t = detail::global_totals();
+  snapshot result;
+  result.shared_increments = t.shared_increments.load(std::memory_order_relaxed);
+  result.shared_decrements = t.shared_decrements.load(std::memory_order_relaxed);
+  result.weak_increments = t.weak_increments.load(std::memory_order_relaxed);
+  result.weak_decrements = t.weak_decrements.load(std::memory_order_relaxed);
+  result.allocations = t.allocations.load(std::memory_order_relaxed);
+  result.live_states = t.live_states.load(std::memory_order_relaxed);
+  return result;
+}
+
+// number of live control blocks managing a pointer of type Ptr (like T* for make_shared<T>)
+template<typename Ptr>
+long live_states() noexcept
+{
+  return detail::live_states<Ptr>().load(std::memory_order_relaxed);
+}
+
+}  // namespace instrumentation
+
+namespace detail {
+
+// Hooks called by the control blocks
+struct hooks {
+  static void shared_increment(int count) noexcept { add(totals().shared_increments, count); }
+  static void shared_decrement(int count) noexcept { add(totals().shared_decrements, count); }
+  static void weak_increment() noexcept { add(totals().weak_increments, 1); }
+  static void weak_decrement() noexcept { add(totals().weak_decrements, 1); }
+  static void allocation() noexcept { add(totals().allocations, 1); }
+
+  using live_counter = std::atomic<long>;
+
+  template<typename Ptr>
+  static live_counter* created() noexcept
+  {
+    live_counter& live = instrumentation::detail::live_states<Ptr>();
+    add(live, 1);
+    add(totals().live_states, 1);
+    return &live;
+  }
+  static void destroyed(live_counter* live) noexcept
+  {
+    if(live) {
+      add(*live, -1);
+      add(totals().live_states, -1);
+    }
+  }
+
+private:
+  static instrumentation::detail::totals& totals() noexcept { return instrumentation::detail::global_totals(); }
+  static void add(live_counter& counter, long value) noexcept { instrumentation::detail::add(counter, value); }
+};
+
+}  // namespace detail
+
+}  // namespace experimental
@@ -0,0 +1,179 @@
+#pragma once
+
+#include "shared_ptr_2.h"
+#include <cstddef>
+#include <cstring>
+#include <initializer_list>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace experimental {
+
+// Moves count objects to uninitialized memory at dest and destroys the originals. Trivially relocatable
+// objects are copied with a single memcpy.
+template<typename T>
+T* uninitialized_relocate_n(T* first, std::size_t count, T* dest) noexcept
+{
+  static_assert(is_trivially_relocatable<T>::value || std::is_nothrow_move_constructible<T>::value,
+                "relocation must not throw");
+  if(is_trivially_relocatable<T>::value) {
+    if(count) {
+      std::memcpy(static_cast<void*>(dest), static_cast<const void*>(first), count * sizeof(T));
+    }
+    return dest + count;
+  }
+  for(std::size_t i = 0; i < count; ++i) {
+    ::new(static_cast<void*>(dest + i)) T(std::move(first[i]));
+    first[i].~T();
+  }
+  return dest + count;
+}
+
+// Minimal vector of trivially relocatable objects
+//
+// Growing copies the elements to the new buffer with memcpy and erasing shifts the tail with memmove,
+// so no move constructors, move assignments nor destructors run for the elements that stay. Only the
+// operations needed to use it as a container of smart pointers are provided.
+template<typename T>
+class relocating_vector {
+  static_assert(is_trivially_relocatable<T>::value, "T has to be trivially relocatable");
+
+  T* data_ = nullptr;
+  std::size_t size_ = 0;
+  std::size_t capacity_ = 0;
+
+  static T* allocate(std::size_t capacity) { return std::allocator<T>{}.allocate(capacity); }
+  static void deallocate(T* data, std::size_t capacity) noexcept
+  {
+    if(data) {
+      std::allocator<T>{}.deallocate(data, capacity);
+    }
+  }
+
+  std::size_t grown_capacity() const noexcept { return capacity_ ? 2 * capacity_ : 8; }
+
+  void destroy(T* first, T* last) noexcept
+  {
+    for(; first != last; ++first) {
+      first->~T();
+    }
+  }
+
+public:
+  using value_type = T;
+  using size_type = std::size_t;
+  using iterator = T*;
+  using const_iterator = const T*;
+
+  relocating_vector() = default;
+  relocating_vector(std::initializer_list<T> init)
+  {
+    reserve(init.size());
+    for(const T& value : init) {
+      push_back(value);
+    }
+  }
+  relocating_vector(relocating_vector&& other) noexcept
+      : data_{std::exchange(other.data_, nullptr)},
+        size_{std::exchange(other.size_, 0)},
+        capacity_{std::exchange(other.capacity_, 0)}
+  {
+  }
+  relocating_vector& operator=(relocating_vector&& other) noexcept
+  {
+    relocating_vector{std::move(other)}.swap(*this);
+    return *this;
+  }
+  ~relocating_vector()
+  {
+    clear();
+    deallocate(data_, capacity_);
+  }
+
+  void swap(relocating_vector& other) noexcept
+  {
+    std::swap(data_, other.data_);
+    std::swap(size_, other.size_);
+    std::swap(capacity_, other.capacity_);
+  }
+
+  void reserve(std::size_t capacity)
+  {
+    if(capacity <= capacity_) {
+      return;
+    }
+    T* data = allocate(capacity);
+    uninitialized_relocate_n(data_, size_, data);
+    deallocate(data_, capacity_);
+    data_ = data;
+    capacity_ = capacity;
+  }
+
+  template<typename... Args>
+  T& emplace_back(Args&&... args)
+  {
+    if(size_ < capacity_) {
+      ::new(static_cast<void*>(data_ + size_)) T(std::forward<Args>(args)...);
+    }
+    else {
+      // the new element is created first as the arguments may refer to the current elements
+      const std::size_t capacity = grown_capacity();
+      T* data = allocate(capacity);
+      try {
+        ::new(static_cast<void*>(data + size_)) T(std::forward<Args>(args)...);
+      }
+      catch(...) {
+        deallocate(data, capacity);
+        throw;
+      }
+      uninitialized_relocate_n(data_, size_, data);
+      deallocate(data_, capacity_);
+      data_ = data;
+      capacity_ = capacity;
+    }
+    return data_[size_++];
+  }
+  void push_back(const T& value) { emplace_back(value); }
+  void push_back(T&& value) { emplace_back(std::move(value)); }
+
+  void pop_back() noexcept { data_[--size_].~T(); }
+
+  iterator erase(const_iterator first, const_iterator last) noexcept
+  {
+    T* begin = data_ + (first - data_);
+    T* end = data_ + (last - data_);
+    destroy(begin, end);
+    const std::size_t tail = static_cast<std::size_t>(data_ + size_ - end);
+    if(tail && begin != end) {
+      std::memmove(static_cast<void*>(begin), static_cast<const void*>(end), tail * sizeof(T));
+    }
+    size_ -= static_cast<std::size_t>(end - begin);
+    return begin;
+  }
+  iterator erase(const_iterator pos) noexcept { return erase(pos, pos + 1); }
+
+  void clear() noexcept
+  {
+    destroy(data_, data_ + size_);
+    size_ = 0;
+  }
+
+  std::size_t size() const noexcept { return size_; }
+  std::size_t capacity() const noexcept { return capacity_; }
+  bool empty() const noexcept { return size_ == 0; }
+
+  T* data() noexcept { return data_; }
+  const T* data() const noexcept { return data_; }
+  T& operator[](std::size_t i) noexcept { return data_[i]; }
+  const T& operator[](std::size_t i) const noexcept { return data_[i]; }
+  T& back() noexcept { return data_[size_ - 1]; }
+
+  iterator begin() noexcept { return data_; }
+  iterator end() noexcept { return data_ + size_; }
+  const_iterator begin() const noexcept { return data_; }
+  const_iterator end() const noexcept { return data_ + size_; }
+};
+
+}  // namespace experimental
@@ -1,589 +1,3049 @@
+#pragma once
+
+#include <array>
 #include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <limits>
+#include <new>
 #include <memory>
 #include <type_traits>
 #include <memory>
 #include <ostream>
+#include <thread>
+#include <utility>
 
-namespace experimental {
-
-namespace detail {
-
-template<typename A>
-class alloc_guard {
-public:
-  using alloc_traits = std::allocator_traits<A>;
-  using pointer = typename alloc_traits::pointer;
-
-  explicit alloc_guard(A& alloc, pointer ptr) noexcept : alloc_{alloc}, ptr_{ptr} {}
-  alloc_guard(const alloc_guard&) = delete;
-  alloc_guard& operator=(const alloc_guard&) = delete;
-  ~alloc_guard()
-  {
-    if(ptr_) {
-      alloc_traits::deallocate(alloc_, ptr_, 1);
-    }
-  }
-  void release() { ptr_ = nullptr; }
+#ifdef SHARED_PTR_2_CONTROL_BLOCK_POOL
+#include "control_block_pool.h"
+#endif
 
-private:
-  A& alloc_;
-  pointer ptr_;
-};
+#ifdef SHARED_PTR_2_INSTRUMENTATION
+#include "instrumentation.h"
+#endif
 
-template<typename T, int Idx, bool UseEbo = !std::is_final<T>::value && std::is_empty<T>::value>
-struct ebo_helper;
+namespace experimental {
 
-template<typename T, int Idx>
-struct ebo_helper<T, Idx, true> : private T
-{
-  template<typename U>
-  constexpr explicit ebo_helper(U&& t) : T{std::forward<U>(t)} {}
-  constexpr T& get() { return *this; }
-  constexpr const T& get() const { return *this; }
-};
+// Reference counting policies
+//
+// A policy provides the storage for the strong and weak counters of a control block together with
+// the operations on them. The weak counter is equal to #weak + (#shared != 0).
 
-template<typename T, int Idx>
-struct ebo_helper<T, Idx, false>
-{
-  template<typename U>
-  constexpr explicit ebo_helper(U&& t) : t_{std::forward<U>(t)} {}
-  constexpr T& get() { return t_; }
-//  constexpr const T& get() const { return t_; }
-private:
-  T t_;
+// Result of releasing a strong reference
+enum class release_result {
+  none,            // there are still other owners
+  last_shared,     // the managed object has to be released but weak references may still exist
+  last_reference   // the whole control block can be destroyed right away
 };
 
-class state_base {
-  virtual void release_ptr() noexcept = 0;
-  virtual void destroy() noexcept = 0;
-
-public:
+// Counters that may be updated concurrently from many threads (the default)
+//
+// Increments can be relaxed as a new reference may only be created from an existing one. Decrements
+// use release ordering and the thread that drops the last reference synchronizes with all of them
+// with an acquire fence before the object or the control block is destroyed.
+class atomic_counters {
   std::atomic_int shared_counter_{1};
-  std::atomic_int weak_counter_{1};    // #weak + (#shared != 0)
+  std::atomic_int weak_counter_{1};
 
-  state_base() = default;
-  state_base(const state_base&) = delete;
-  state_base& operator=(const state_base&) = delete;
-  virtual ~state_base() = default;
-
-  void release()
+public:
+  void add_shared(int count = 1) noexcept { shared_counter_.fetch_add(count, std::memory_order_relaxed); }
+  release_result release_shared() noexcept
+  {
+    // there is no unique owner fast path here as the two counters cannot be read with one load (see
+    // packed_counters), a weak_ptr could be locked and dropped in between
+    if(shared_counter_.fetch_sub(1, std::memory_order_release) == 1) {
+      std::atomic_thread_fence(std::memory_order_acquire);
+      return release_result::last_shared;
+    }
+    return release_result::none;
+  }
+  // releases count references at once
+  release_result release_shared(int count) noexcept
   {
-    if(--shared_counter_ == 0) {
-      release_ptr();
-      if(--weak_counter_ == 0) {
-        destroy();
+    if(shared_counter_.fetch_sub(count, std::memory_order_release) == count) {
+      std::atomic_thread_fence(std::memory_order_acquire);
+      return release_result::last_shared;
+    }
+    return release_result::none;
+  }
+  // returns false if there are no owners left
+  bool try_add_shared() noexcept
+  {
+    int count = shared_counter_.load(std::memory_order_relaxed);
+    while(count != 0) {
+      if(shared_counter_.compare_exchange_weak(count, count + 1, std::memory_order_relaxed)) {
+        return true;
       }
     }
+    return false;
   }
-
-  void weak_release()
+  void add_weak() noexcept { weak_counter_.fetch_add(1, std::memory_order_relaxed); }
+  bool release_weak() noexcept
   {
-    if(--weak_counter_ == 0) {
-      destroy();
+    if(weak_counter_.load(std::memory_order_acquire) == 1) {
+      return true;
     }
+    if(weak_counter_.fetch_sub(1, std::memory_order_release) == 1) {
+      std::atomic_thread_fence(std::memory_order_acquire);
+      return true;
+    }
+    return false;
   }
-
-  long use_count() const noexcept { return shared_counter_.load(); }
+  long use_count() const noexcept { return shared_counter_.load(std::memory_order_relaxed); }
 };
 
-template<typename Ptr,
-         typename D = std::default_delete<std::remove_pointer_t<Ptr>>,
-         typename A = std::allocator<std::remove_pointer_t<Ptr>>>
-class state final : public state_base, private ebo_helper<D, 0>, private ebo_helper<A, 1> {
-  using DBase = ebo_helper<D, 0>;
-  using ABase = ebo_helper<A, 1>;
-  Ptr ptr_;
-  D& deleter() { return static_cast<DBase&>(*this).get(); }
-  A& allocator() { return static_cast<ABase&>(*this).get(); }
-public:
-  using allocator_type = typename std::allocator_traits<A>::template rebind_alloc<state>;
-  explicit state(Ptr ptr) noexcept : state{ptr, D{}, A{}} {}
-  template<typename DD>
-  state(Ptr ptr, DD&& d) noexcept : state{ptr, std::forward<DD>(d), A{}} {}
-  template<typename DD, typename AA>
-  state(Ptr ptr, DD&& d, AA&& a) noexcept : DBase{std::forward<DD>(d)}, ABase{std::forward<AA>(a)}, ptr_{ptr} {}
+// Plain counters for ownership graphs that never leave one thread
+class local_counters {
+  int shared_counter_ = 1;
+  int weak_counter_ = 1;
 
-  void release_ptr() noexcept override { deleter()(ptr_); }
-  void destroy() noexcept override
+public:
+  void add_shared(int count = 1) noexcept { shared_counter_ += count; }
+  release_result release_shared() noexcept
   {
-    allocator_type alloc{allocator()};
-    using alloc_traits = std::allocator_traits<allocator_type>;
-    alloc_guard<allocator_type> guard{alloc, this};
-    alloc_traits::destroy(alloc, this);
+    return --shared_counter_ == 0 ? release_result::last_shared : release_result::none;
+  }
+  release_result release_shared(int count) noexcept
+  {
+    return (shared_counter_ -= count) == 0 ? release_result::last_shared : release_result::none;
   }
+  bool try_add_shared() noexcept
+  {
+    if(shared_counter_ > 0) {
+      ++shared_counter_;
+      return true;
+    }
+    return false;
+  }
+  void add_weak() noexcept { ++weak_counter_; }
+  bool release_weak() noexcept { return --weak_counter_ == 0; }
+  long use_count() const noexcept { return shared_counter_; }
 };
 
-class weak_state;
+// Both counters packed into one 64-bit atomic word (strong count in the lower half)
+//
+// Releasing the last owner of an object without weak references takes a single RMW operation and
+// weak to strong promotion is a single CAS on the same word.
+class packed_counters {
+  using word_type = std::uint64_t;
+  static constexpr word_type shared_one = 1;
+  static constexpr word_type weak_one = word_type{1} << 32;
+  static constexpr word_type shared_mask = weak_one - 1;
 
-class shared_state {
-  friend class weak_state;
-  state_base* base_ = nullptr;
-public:
-  shared_state() = default;
+  std::atomic<word_type> word_{shared_one | weak_one};
 
-  template<typename Ptr>
-  explicit shared_state(Ptr p) try : base_{new state<Ptr>{p}}
+public:
+  void add_shared(int count = 1) noexcept
   {
+    word_.fetch_add(static_cast<word_type>(count), std::memory_order_relaxed);
   }
-  catch(...) {
-    delete p;
-    throw;
-  }
-
-  template<typename Ptr, typename D>
-  shared_state(Ptr p, D&& d) try : base_{new state<Ptr, D>{p, std::forward<D>(d)}}
+  release_result release_shared() noexcept
   {
+    if(word_.load(std::memory_order_acquire) == (shared_one | weak_one)) {
+      return release_result::last_reference;
+    }
+    const word_type old = word_.fetch_sub(shared_one, std::memory_order_release);
+    if((old & shared_mask) != 1) {
+      return release_result::none;
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+    // without weak references nobody else can reach the counters anymore
+    return old == (shared_one | weak_one) ? release_result::last_reference : release_result::last_shared;
   }
-  catch(...) {
-    d(p);
-    throw;
-  }
-
-  template<typename Ptr, typename D, typename A>
-  shared_state(Ptr p, D&& d, A&& a) try
+  release_result release_shared(int count) noexcept
   {
-    using state_type = state<Ptr, D, A>;
-    using alloc_traits = std::allocator_traits<typename state_type::allocator_type>;
-
-    typename state_type::allocator_type alloc{a};
-    state_type* buffer = alloc_traits::allocate(alloc, 1);
-    alloc_guard<typename state_type::allocator_type> guard{alloc, buffer};
-    alloc_traits::construct(alloc, buffer, p, std::forward<D>(d), std::forward<A>(a));
-    guard.release();
-    base_ = buffer;
+    const word_type n = static_cast<word_type>(count);
+    const word_type old = word_.fetch_sub(n * shared_one, std::memory_order_release);
+    if((old & shared_mask) != n) {
+      return release_result::none;
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return old == (n | weak_one) ? release_result::last_reference : release_result::last_shared;
   }
-  catch(...) {
-    d(p);
-    throw;
+  bool try_add_shared() noexcept
+  {
+    word_type w = word_.load(std::memory_order_relaxed);
+    while(w & shared_mask) {
+      if(word_.compare_exchange_weak(w, w + shared_one, std::memory_order_relaxed)) {
+        return true;
+      }
+    }
+    return false;
   }
-
-  shared_state(const shared_state& other) noexcept : base_{other.base_}
+  void add_weak() noexcept { word_.fetch_add(weak_one, std::memory_order_relaxed); }
+  bool release_weak() noexcept
   {
-    if(base_) {
-      ++base_->shared_counter_;
+    if(word_.fetch_sub(weak_one, std::memory_order_release) >> 32 == 1) {
+      std::atomic_thread_fence(std::memory_order_acquire);
+      return true;
     }
+    return false;
   }
+  long use_count() const noexcept { return static_cast<long>(word_.load(std::memory_order_relaxed) & shared_mask); }
+};
 
-  shared_state(const weak_state& other);
-  shared_state(const weak_state& other, std::nothrow_t);
+class biased_counters;
 
-  shared_state(shared_state&& other) noexcept : base_{other.base_}
+namespace detail {
+
+// Per-thread record of an owner of biased counters
+//
+// Other threads push the counters that need a merge with the owner's biased count to its queue. When the
+// thread exits the queue is closed and later pushes merge right away as nobody touches the biased count
+// anymore. Only threads that create control blocks get a record. Records are never freed as counters of
+// objects that outlive their owner still refer to them.
+class biased_owner {
+  std::atomic<biased_counters*> queue_{nullptr};
+  biased_owner* next_ = nullptr;  // all records ever created
+
+  static biased_counters* closed() noexcept { return reinterpret_cast<biased_counters*>(alignof(std::max_align_t)); }
+
+  struct thread_guard {
+    biased_owner* owner = nullptr;
+    ~thread_guard();
+  };
+  static thread_guard& guard() noexcept
   {
-    other.base_ = nullptr;
+    static thread_local thread_guard g;
+    return g;
+  }
+  static bool& exited() noexcept
+  {
+    static thread_local bool flag = false;
+    return flag;
   }
 
-  ~shared_state()
+public:
+  // nullptr if the thread is already exiting or the record could not be allocated
+  static biased_owner* current() noexcept
   {
-    if(base_){
-      base_->release();
+    if(exited()) {
+      return nullptr;
+    }
+    thread_guard& g = guard();
+    if(!g.owner) {
+      g.owner = new(std::nothrow) biased_owner;
+      if(g.owner) {
+        static std::atomic<biased_owner*> records{nullptr};
+        g.owner->next_ = records.load(std::memory_order_relaxed);
+        while(!records.compare_exchange_weak(g.owner->next_, g.owner, std::memory_order_relaxed)) {
+        }
+      }
     }
+    return g.owner;
   }
+  // record of the calling thread without creating one
+  static biased_owner* peek() noexcept { return exited() ? nullptr : guard().owner; }
 
-  long use_count() const noexcept { return base_ ? base_->use_count() : 0; }
+  void push(biased_counters& counters) noexcept;
+  std::size_t merge_queued() noexcept;
+  // called by the owner on its slow paths so that queued blocks do not wait for an explicit merge
+  void drain() noexcept
+  {
+    if(queue_.load(std::memory_order_relaxed)) {
+      merge_queued();
+    }
+  }
 };
 
-
-class weak_state {
-  friend class shared_state;
-  state_base* base_ = nullptr;
-public:
-  weak_state() = default;
-
-  weak_state(const weak_state& other) noexcept : base_{other.base_}
+}  // namespace detail
+
+// Biased reference counting (Choi, Shull and Torrellas)
+//
+// The thread that creates the control block owns it. The owner updates a biased counter with plain
+// loads and stores while all other threads use an atomic counter that may become negative when they
+// release references created by the owner. When the biased counter drops to zero the owner merges both
+// counters and the atomic one is used by everybody from then on. A non-owner that first makes the atomic
+// counter negative queues the control block to its owner, which merges it when it creates another control
+// block, when its biased counter drops to zero, in merge_queued() or when it exits. Until then the object
+// stays alive even if no references to it remain.
+class biased_counters {
+  friend class detail::biased_owner;
+
+  // the atomic word holds 4 * count + flags
+  using word_type = std::int64_t;
+  static constexpr word_type merged = 1;
+  static constexpr word_type queued = 2;
+  static constexpr word_type shared_one = 4;
+
+  detail::biased_owner* const owner_;
+  std::atomic_int biased_;
+  std::atomic<word_type> shared_;
+  std::atomic_int weak_counter_{1};
+  biased_counters* next_ = nullptr;
+  void* base_ = nullptr;
+  void (*finish_)(void*) = nullptr;
+
+  static word_type count(word_type w) noexcept { return (w - (w & (merged | queued))) / shared_one; }
+  bool owned() const noexcept { return owner_ && owner_ == detail::biased_owner::peek(); }
+  // only the owner sets the merged flag so it can check it with a relaxed load
+  bool owner_fast_path() const noexcept { return owned() && !(shared_.load(std::memory_order_relaxed) & merged); }
+
+  // called by the owner or after it exited; returns true if the object has to be released
+  bool merge() noexcept
   {
-    if(base_) {
-      ++base_->weak_counter_;
+    const word_type biased = biased_.load(std::memory_order_relaxed);
+    biased_.store(0, std::memory_order_relaxed);
+    word_type w = shared_.load(std::memory_order_relaxed);
+    while(!shared_.compare_exchange_weak(w, ((w + biased * shared_one) | merged) & ~queued, std::memory_order_acq_rel,
+                                         std::memory_order_relaxed)) {
     }
+    return count(w) + biased == 0;
   }
+  void finish() noexcept { finish_(base_); }
 
-  weak_state(const shared_state& other) noexcept : base_{other.base_}
+public:
+  biased_counters() noexcept
+      : owner_{detail::biased_owner::current()},
+        biased_{owner_ ? 1 : 0},
+        shared_{owner_ ? word_type{0} : shared_one | merged}
   {
-    if(base_) {
-      ++base_->weak_counter_;
+    if(owner_) {
+      owner_->drain();
     }
   }
+  biased_counters(const biased_counters&) = delete;
+  biased_counters& operator=(const biased_counters&) = delete;
 
-  weak_state(weak_state&& other) noexcept : base_{other.base_}
+  // control block to be released when a queued merge finds no references left
+  template<typename Base>
+  void attach(Base& base) noexcept
   {
-    other.base_ = nullptr;
+    base_ = &base;
+    finish_ = [](void* b) { static_cast<Base*>(b)->finish_release(); };
   }
 
-  weak_state& operator=(const weak_state& other) noexcept
+  void add_shared(int count = 1) noexcept
   {
-    if(other.base_) {
-      ++other.base_->weak_counter_;
+    if(owner_fast_path()) {
+      biased_.store(biased_.load(std::memory_order_relaxed) + count, std::memory_order_relaxed);
     }
-    if(base_) {
-      base_->weak_release();
+    else {
+      shared_.fetch_add(count * shared_one, std::memory_order_relaxed);
     }
-    base_ = other.base_;
-    return *this;
   }
-
-  weak_state& operator=(const shared_state& other) noexcept
+  release_result release_shared() noexcept
   {
-    if(other.base_) {
-      ++other.base_->weak_counter_;
+    word_type w = shared_.load(std::memory_order_relaxed);
+    if(owned() && !(w & merged)) {
+      const int biased = biased_.load(std::memory_order_relaxed) - 1;
+      biased_.store(biased, std::memory_order_relaxed);
+      detail::biased_owner* owner = owner_;
+      if(biased != 0) {
+        // other threads released references created here, the merge may release this control block
+        if(w & queued) {
+          owner->drain();
+        }
+        return release_result::none;
+      }
+      w = shared_.fetch_or(merged, std::memory_order_acq_rel);
+      // a queued block is released by the merge of the queue
+      const release_result result =
+          count(w) == 0 && !(w & queued) ? release_result::last_shared : release_result::none;
+      owner->drain();  // may release this control block if it was queued
+      return result;
     }
-    if(base_) {
-      base_->weak_release();
+    word_type next;
+    do {
+      next = w - shared_one;
+      if(!(next & (merged | queued)) && count(next) < 0) {
+        next |= queued;
+      }
+    } while(!shared_.compare_exchange_weak(w, next, std::memory_order_release, std::memory_order_relaxed));
+    if((next & queued) && !(w & queued)) {
+      owner_->push(*this);
+      return release_result::none;
     }
-    base_ = other.base_;
-    return *this;
+    if((next & merged) && !(next & queued) && count(next) == 0) {
+      std::atomic_thread_fence(std::memory_order_acquire);
+      return release_result::last_shared;
+    }
+    return release_result::none;
   }
-
-  weak_state& operator=(weak_state&& other) noexcept
+  // fails only after the merge found no references; before that a queued object may still be revived
+  bool try_add_shared() noexcept
   {
-    if(base_) {
-      base_->weak_release();
+    if(owner_fast_path()) {
+      biased_.store(biased_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+      return true;
     }
-    base_ = other.base_;
-    other.base_ = nullptr;
-    return *this;
+    word_type w = shared_.load(std::memory_order_relaxed);
+    while(!((w & merged) && count(w) == 0)) {
+      if(shared_.compare_exchange_weak(w, w + shared_one, std::memory_order_relaxed)) {
+        return true;
+      }
+    }
+    return false;
   }
-
-  ~weak_state()
+  void add_weak() noexcept { weak_counter_.fetch_add(1, std::memory_order_relaxed); }
+  bool release_weak() noexcept
   {
-    if(base_){
-      base_->weak_release();
+    if(weak_counter_.fetch_sub(1, std::memory_order_release) == 1) {
+      std::atomic_thread_fence(std::memory_order_acquire);
+      return true;
     }
+    return false;
+  }
+  long use_count() const noexcept
+  {
+    return static_cast<long>(biased_.load(std::memory_order_relaxed) + count(shared_.load(std::memory_order_relaxed)));
   }
 
-  long use_count() const noexcept { return base_ ? base_->use_count() : 0; }
-  bool expired() const noexcept { return base_ == nullptr; }
+  // merges the counters queued to the calling thread by other threads, returns their number
+  static std::size_t merge_queued() noexcept
+  {
+    detail::biased_owner* owner = detail::biased_owner::peek();
+    return owner ? owner->merge_queued() : 0;
+  }
 };
 
+namespace detail {
 
-shared_state::shared_state(const weak_state& other) : base_{other.base_}
+inline void biased_owner::push(biased_counters& counters) noexcept
 {
-  // TODO add atomic operation
-  if(base_ && base_->shared_counter_.load() > 0) {
-    ++base_->shared_counter_;
-  }
-  else {
-    throw std::bad_weak_ptr{};
-  }
+  biased_counters* head = queue_.load(std::memory_order_acquire);
+  do {
+    if(head == closed()) {
+      if(counters.merge()) {
+        counters.finish();
+      }
+      return;
+    }
+    counters.next_ = head;
+  } while(!queue_.compare_exchange_weak(head, &counters, std::memory_order_release, std::memory_order_acquire));
 }
 
-shared_state::shared_state(const weak_state& other, std::nothrow_t) : base_{other.base_}
+inline std::size_t biased_owner::merge_queued() noexcept
 {
-  // TODO add atomic operation
-  if(base_ && base_->shared_counter_.load() > 0) {
-    ++base_->shared_counter_;
+  std::size_t merged_count = 0;
+  while(biased_counters* list = queue_.exchange(nullptr, std::memory_order_acquire)) {
+    while(list) {
+      biased_counters* next = list->next_;
+      if(list->merge()) {
+        list->finish();
+      }
+      list = next;
+      ++merged_count;
+    }
   }
+  return merged_count;
 }
 
+inline biased_owner::thread_guard::~thread_guard()
+{
+  exited() = true;
+  if(owner) {
+    owner->merge_queued();
+    // merges the blocks pushed in the meantime until the queue gets closed
+    biased_counters* list = owner->queue_.exchange(closed(), std::memory_order_acq_rel);
+    while(list) {
+      biased_counters* next = list->next_;
+      if(list->merge()) {
+        list->finish();
+      }
+      list = next;
+    }
+  }
 }
 
-template <typename T>
-class shared_ptr;
+}  // namespace detail
 
-template <typename T>
-class weak_ptr {
-  template<typename U>
-  using Convertible = std::enable_if_t<std::is_convertible<U, T*>::value>;
+namespace detail {
 
-  T* ptr_ = nullptr;
-  detail::weak_state state_;
+// std::hardware_destructive_interference_size is not available before C++17
+constexpr std::size_t cache_line_size = 64;
 
-  template<typename U> friend class weak_ptr;
-  template<typename U> friend class shared_ptr;
+// Small number identifying the calling thread, handed out in the order of the first call
+inline unsigned thread_slot() noexcept
+{
+  static std::atomic<unsigned> next{0};
+  static thread_local const unsigned slot = next.fetch_add(1, std::memory_order_relaxed);
+  return slot;
+}
 
-public:
-  using element_type = std::remove_extent_t<T>;
+// Hints the CPU to start loading the cache line of p for writing
+inline void prefetch_for_write(const void* p) noexcept
+{
+#if defined(__GNUC__) || defined(__clang__)
+  __builtin_prefetch(p, 1);
+#else
+  (void)p;
+#endif
+}
 
-// 20.11.2.3.1, constructors
-  constexpr weak_ptr() noexcept = default;
+// Mixes all bits of an address into the low ones so that aligned pointers spread evenly over the
+// buckets of a hash table (the 64-bit finalizer of MurmurHash3)
+inline std::size_t hash_pointer(const void* p) noexcept
+{
+  auto x = static_cast<std::uint64_t>(reinterpret_cast<std::uintptr_t>(p));
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdull;
+  x ^= x >> 33;
+  x *= 0xc4ceb9fe1a85ec53ull;
+  x ^= x >> 33;
+  return static_cast<std::size_t>(x);
+}
 
-  // lock() is needed in case of converting operation. r.ptr_ may already
-  // have been invalidated in multithreaded application. The ptr_(r.ptr_)
-  // conversion may require access to *r.ptr_ (virtual inheritance).
-  template<class Y, typename = Convertible<Y*>>
-  weak_ptr(const shared_ptr<Y>& r) noexcept : ptr_{r.ptr_}, state_{r.state_}
+}  // namespace detail
+
+// Strong counter sharded across cache lines for objects copied by many threads at the same time
+//
+// Every thread updates the slot selected by its thread_slot() so copies made on different cores do not
+// fight for one cache line. A slot never becomes negative. The central word holds the references that
+// are not kept in any slot (lower half) and one token for every non-empty slot (upper half). A token
+// is taken before a slot becomes non-empty and given back after it becomes empty again, so the word
+// drops to zero only after the last reference is gone. A release that finds the slot of its thread
+// empty (the reference was created by another thread) takes the reference from the central word or
+// steals one from another slot.
+//
+// The counters occupy Slots + 1 cache lines, so they are meant for a few extremely hot objects only.
+template<std::size_t Slots = 16>
+class sharded_counters {
+  static_assert(Slots > 0, "at least one slot is needed");
+
+  using word_type = std::uint64_t;
+  static constexpr word_type reference_one = 1;
+  static constexpr word_type token_one = word_type{1} << 32;
+  static constexpr word_type reference_mask = token_one - 1;
+  static constexpr std::size_t cache_line = detail::cache_line_size;
+
+  // slots are a cache line apart even if the counters themselves are not aligned to one
+  struct slot {
+    std::atomic<long> count{0};
+    char padding[cache_line - sizeof(std::atomic<long>)];
+  };
+
+  std::atomic<word_type> central_{reference_one};
+  std::atomic_int weak_counter_{1};
+  char padding_[cache_line - sizeof(std::atomic<word_type>) - sizeof(std::atomic_int)];
+  slot slots_[Slots];
+
+  slot& own_slot() noexcept { return slots_[detail::thread_slot() % Slots]; }
+
+  // returns true if the last reference was released
+  bool release_central(word_type one) noexcept { return central_.fetch_sub(one, std::memory_order_acq_rel) == one; }
+
+  // returns false if the slot is empty
+  bool take_from(slot& s, bool& last) noexcept
   {
+    long count = s.count.load(std::memory_order_relaxed);
+    while(count > 0) {
+      if(s.count.compare_exchange_weak(count, count - 1, std::memory_order_acq_rel, std::memory_order_relaxed)) {
+        last = count == 1 && release_central(token_one);
+        return true;
+      }
+    }
+    return false;
   }
 
-  weak_ptr(weak_ptr const& r) noexcept = default;
-
-  template<class Y, typename = Convertible<Y*>>
-  weak_ptr(const weak_ptr<Y>& r) noexcept : ptr_{r.lock().get()}, state_{r.state_}
+  // the slot of the calling thread is empty
+  bool release_elsewhere() noexcept
   {
+    word_type w = central_.load(std::memory_order_relaxed);
+    while(true) {
+      if(w & reference_mask) {
+        if(central_.compare_exchange_weak(w, w - reference_one, std::memory_order_acq_rel, std::memory_order_relaxed)) {
+          return w == reference_one;
+        }
+        continue;
+      }
+      // the reference is kept by some slot as the caller still owns one
+      for(slot& s : slots_) {
+        bool last = false;
+        if(take_from(s, last)) {
+          return last;
+        }
+      }
+      w = central_.load(std::memory_order_relaxed);
+    }
   }
 
-  weak_ptr(weak_ptr&& r) noexcept : ptr_{std::move(r.ptr_)}, state_{std::move(r.state_)}
-  {
-    r.ptr_ = nullptr;
-  }
+public:
+  sharded_counters() = default;
+  sharded_counters(const sharded_counters&) = delete;
+  sharded_counters& operator=(const sharded_counters&) = delete;
 
-  template<class Y, typename = Convertible<Y*>>
-  weak_ptr(weak_ptr<Y>&& r) noexcept : ptr_{r.lock().get()}, state_{std::move(r.state_)}
+  void add_shared(int count = 1) noexcept
   {
-    r.ptr_ = nullptr;
+    slot& s = own_slot();
+    long c = s.count.load(std::memory_order_relaxed);
+    while(true) {
+      if(c > 0) {
+        if(s.count.compare_exchange_weak(c, c + count, std::memory_order_relaxed)) {
+          return;
+        }
+        continue;
+      }
+      // releasing the slot publishes the token to whoever empties it later
+      central_.fetch_add(token_one, std::memory_order_relaxed);
+      if(s.count.compare_exchange_strong(c, c + count, std::memory_order_release, std::memory_order_relaxed)) {
+        return;
+      }
+      // another thread sharing the slot was faster; the caller still owns a reference so this is not the last token
+      central_.fetch_sub(token_one, std::memory_order_relaxed);
+    }
   }
-
-// 20.11.2.3.2, destructor
-  ~weak_ptr() = default;
-
-// 20.11.2.3.3, assignment
-  weak_ptr& operator=(const weak_ptr& r) noexcept
+  release_result release_shared() noexcept
   {
-    ptr_ = r.ptr_;
-    state_ = r.state_;
-    return *this;
+    bool last = false;
+    if(!take_from(own_slot(), last)) {
+      last = release_elsewhere();
+    }
+    return last ? release_result::last_shared : release_result::none;
   }
-  template<class Y> weak_ptr& operator=(const weak_ptr<Y>& r) noexcept
+  // may still succeed while the thread releasing the last reference from a slot gives back its token
+  bool try_add_shared() noexcept
   {
-    ptr_ = r.lock().get();
-    state_ = r.state_;
-    return *this;
+    word_type w = central_.load(std::memory_order_relaxed);
+    while(w != 0) {
+      if(central_.compare_exchange_weak(w, w + reference_one, std::memory_order_relaxed)) {
+        return true;
+      }
+    }
+    return false;
   }
-
-  template<class Y> weak_ptr& operator=(const shared_ptr<Y>& r) noexcept
+  void add_weak() noexcept { weak_counter_.fetch_add(1, std::memory_order_relaxed); }
+  bool release_weak() noexcept
   {
-    ptr_ = r.ptr_;
-    state_ = r.state_;
-    return *this;
+    if(weak_counter_.fetch_sub(1, std::memory_order_release) == 1) {
+      std::atomic_thread_fence(std::memory_order_acquire);
+      return true;
+    }
+    return false;
   }
-  weak_ptr& operator=(weak_ptr&& r) noexcept
+  long use_count() const noexcept
+  {
+    long count = static_cast<long>(central_.load(std::memory_order_relaxed) & reference_mask);
+    for(const slot& s : slots_) {
+      count += s.count.load(std::memory_order_relaxed);
+    }
+    return count;
+  }
+};
+
+namespace detail {
+
+struct cache_line_padding {
+  char bytes[cache_line_size];
+};
+
+}  // namespace detail
+
+// Counters kept in cache lines of their own
+//
+// A whole cache line of padding on both sides keeps the counters apart from the managed object stored
+// right after them by make_shared and from the neighbouring allocations, so reference counting traffic
+// does not invalidate the data other threads read or write. Padding is used instead of alignment as
+// allocators are not required to honor over-aligned types before C++17. Any other policy may be padded.
+template<typename Counters = atomic_counters>
+class padded_counters : private detail::cache_line_padding, public Counters {
+  detail::cache_line_padding back_;
+
+public:
+  padded_counters() = default;
+};
+
+namespace detail {
+
+template<typename A>
+class alloc_guard {
+public:
+  using alloc_traits = std::allocator_traits<A>;
+  using pointer = typename alloc_traits::pointer;
+
+  explicit alloc_guard(A& alloc, pointer ptr) noexcept : alloc_{alloc}, ptr_{ptr} {}
+  alloc_guard(const alloc_guard&) = delete;
+  alloc_guard& operator=(const alloc_guard&) = delete;
+  ~alloc_guard()
+  {
+    if(ptr_) {
+      alloc_traits::deallocate(alloc_, ptr_, 1);
+    }
+  }
+  void release() { ptr_ = nullptr; }
+
+private:
+  A& alloc_;
+  pointer ptr_;
+};
+
+template<typename T, int Idx, bool UseEbo = !std::is_final<T>::value && std::is_empty<T>::value>
+struct ebo_helper;
+
+template<typename T, int Idx>
+struct ebo_helper<T, Idx, true> : private T
+{
+  template<typename U>
+  constexpr explicit ebo_helper(U&& t) : T{std::forward<U>(t)} {}
+  constexpr T& get() { return *this; }
+  constexpr const T& get() const { return *this; }
+};
+
+template<typename T, int Idx>
+struct ebo_helper<T, Idx, false>
+{
+  template<typename U>
+  constexpr explicit ebo_helper(U&& t) : t_{std::forward<U>(t)} {}
+  constexpr T& get() { return t_; }
+//  constexpr const T& get() const { return t_; }
+private:
+  T t_;
+};
+
+template<typename Counters>
+class state_base;
+
+// Type-erased operations of a control block
+//
+// Every control block type provides one static table of them instead of a vtable.
+template<typename Counters>
+struct state_ops {
+  void (*release_ptr)(state_base<Counters>&) noexcept;
+  void (*destroy)(state_base<Counters>&) noexcept;
+  void (*release_ptr_and_destroy)(state_base<Counters>&) noexcept;
+};
+
+#ifndef SHARED_PTR_2_INSTRUMENTATION
+// Instrumentation hooks compiled out (see instrumentation.h)
+struct hooks {
+  static void shared_increment(int) noexcept {}
+  static void shared_decrement(int) noexcept {}
+  static void weak_increment() noexcept {}
+  static void weak_decrement() noexcept {}
+  static void allocation() noexcept {}
+};
+#endif
+
+// Counters may release many references with one operation. Otherwise they are released one by one.
+template<typename Counters>
+auto release_shared_n(Counters& counters, int count, int) noexcept -> decltype(counters.release_shared(count))
+{
+  return counters.release_shared(count);
+}
+template<typename Counters>
+release_result release_shared_n(Counters& counters, int count, long) noexcept
+{
+  while(--count > 0) {
+    counters.release_shared();
+  }
+  return counters.release_shared();
+}
+
+// Counters that release the object on their own (like biased_counters) get to know their control block
+template<typename Counters, typename Base>
+auto attach_counters(Counters& counters, Base& base, int) noexcept -> decltype(counters.attach(base))
+{
+  counters.attach(base);
+}
+template<typename Counters, typename Base>
+void attach_counters(Counters&, Base&, long) noexcept
+{
+}
+
+template<typename Counters>
+class state_base {
+  // nullptr means that the managed object needs no cleanup and the control block was obtained from
+  // global operator new, so the last release does not have to make any indirect call
+  const state_ops<Counters>* ops_;
+  Counters counters_;
+#ifdef SHARED_PTR_2_INSTRUMENTATION
+  hooks::live_counter* live_ = nullptr;
+#endif
+
+  void release_ptr() noexcept
+  {
+    if(ops_) {
+      ops_->release_ptr(*this);
+    }
+  }
+
+  static void destroy_trivial(state_base* self) noexcept
+  {
+    self->~state_base();
+    void* storage = self;
+#if defined(__GNUC__)
+    // Hides that the freed memory is the control block. GCC cannot rule out that another owner inlined
+    // into the same caller still updates the counters afterwards and would report a use after free.
+    // The empty statement costs nothing.
+    __asm__("" : "+r"(storage));
+#endif
+    ::operator delete(storage);
+  }
+
+  void destroy() noexcept
+  {
+    if(ops_) {
+      ops_->destroy(*this);
+    }
+    else {
+      destroy_trivial(this);
+    }
+  }
+
+  void release_ptr_and_destroy() noexcept
+  {
+    if(ops_) {
+      ops_->release_ptr_and_destroy(*this);
+    }
+    else {
+      destroy_trivial(this);
+    }
+  }
+
+  void released(release_result result)
+  {
+    switch(result) {
+      case release_result::none:
+        break;
+      case release_result::last_shared:
+        release_ptr();
+        weak_release();
+        break;
+      case release_result::last_reference:
+        hooks::weak_decrement();
+        release_ptr_and_destroy();
+        break;
+    }
+  }
+
+protected:
+  explicit state_base(const state_ops<Counters>* ops) noexcept : ops_{ops} { attach_counters(counters_, *this, 0); }
+#ifdef SHARED_PTR_2_INSTRUMENTATION
+  ~state_base() { hooks::destroyed(live_); }
+#else
+  ~state_base() = default;
+#endif
+
+  // counts the control block among the live ones managing a pointer of type Ptr
+  template<typename Ptr>
+  void track() noexcept
+  {
+#ifdef SHARED_PTR_2_INSTRUMENTATION
+    live_ = hooks::created<Ptr>();
+#endif
+  }
+
+  // for control blocks that learn the type of their object only when it gets adopted
+  const state_ops<Counters>* ops() const noexcept { return ops_; }
+  void set_ops(const state_ops<Counters>* ops) noexcept { ops_ = ops; }
+
+public:
+  state_base(const state_base&) = delete;
+  state_base& operator=(const state_base&) = delete;
+
+  void add_shared(int count = 1) noexcept
+  {
+    hooks::shared_increment(count);
+    counters_.add_shared(count);
+  }
+  bool try_add_shared() noexcept
+  {
+    if(!counters_.try_add_shared()) {
+      return false;
+    }
+    hooks::shared_increment(1);
+    return true;
+  }
+  void add_weak() noexcept
+  {
+    hooks::weak_increment();
+    counters_.add_weak();
+  }
+
+  void release()
+  {
+    hooks::shared_decrement(1);
+    released(counters_.release_shared());
+  }
+
+  // releases count references at once
+  void release(int count)
+  {
+    hooks::shared_decrement(count);
+    released(release_shared_n(counters_, count, 0));
+  }
+
+  // releases the only reference of a control block that has never been shared so no update of the
+  // counters is needed
+  void release_unique() noexcept
+  {
+    hooks::shared_decrement(1);
+    hooks::weak_decrement();
+    release_ptr_and_destroy();
+  }
+
+  // the counters found out on their own that no owners are left
+  void finish_release() noexcept
+  {
+    release_ptr();
+    weak_release();
+  }
+
+  void weak_release()
+  {
+    hooks::weak_decrement();
+    if(counters_.release_weak()) {
+      destroy();
+    }
+  }
+
+  long use_count() const noexcept { return counters_.use_count(); }
+};
+
+// Allocator of control blocks for pointers adopted without a user provided allocator
+//
+// Defining SHARED_PTR_2_CONTROL_BLOCK_POOL takes them from the thread-caching pool. Otherwise the pool
+// may still be selected for a single construction by passing pool_allocator to shared_ptr.
+#ifdef SHARED_PTR_2_CONTROL_BLOCK_POOL
+template<typename T>
+using default_state_allocator = pool_allocator<T>;
+#else
+template<typename T>
+using default_state_allocator = std::allocator<T>;
+#endif
+
+template<typename Counters,
+         typename Ptr,
+         typename D = std::default_delete<std::remove_pointer_t<Ptr>>,
+         typename A = default_state_allocator<std::remove_pointer_t<Ptr>>>
+class state final : public state_base<Counters>, private ebo_helper<D, 0>, private ebo_helper<A, 1> {
+  using DBase = ebo_helper<D, 0>;
+  using ABase = ebo_helper<A, 1>;
+  Ptr ptr_;
+  D& deleter() { return static_cast<DBase&>(*this).get(); }
+  A& allocator() { return static_cast<ABase&>(*this).get(); }
+
+  static void release_ptr(state_base<Counters>& base) noexcept
+  {
+    state& self = static_cast<state&>(base);
+    self.deleter()(self.ptr_);
+  }
+  static void destroy(state_base<Counters>& base) noexcept
+  {
+    state& self = static_cast<state&>(base);
+    allocator_type alloc{self.allocator()};
+    using alloc_traits = std::allocator_traits<allocator_type>;
+    alloc_guard<allocator_type> guard{alloc, &self};
+    alloc_traits::destroy(alloc, &self);
+  }
+  static void release_ptr_and_destroy(state_base<Counters>& base) noexcept
+  {
+    release_ptr(base);
+    destroy(base);
+  }
+  static constexpr state_ops<Counters> ops{&release_ptr, &destroy, &release_ptr_and_destroy};
+
+public:
+  using allocator_type = typename std::allocator_traits<A>::template rebind_alloc<state>;
+  explicit state(Ptr ptr) noexcept : state{ptr, D{}, A{}} {}
+  template<typename DD>
+  state(Ptr ptr, DD&& d) noexcept : state{ptr, std::forward<DD>(d), A{}} {}
+  template<typename DD, typename AA>
+  state(Ptr ptr, DD&& d, AA&& a) noexcept
+      : state_base<Counters>{&ops}, DBase{std::forward<DD>(d)}, ABase{std::forward<AA>(a)}, ptr_{ptr}
+  {
+    this->template track<Ptr>();
+  }
+};
+
+template<typename Counters, typename Ptr, typename D, typename A>
+constexpr state_ops<Counters> state<Counters, Ptr, D, A>::ops;
+
+// Control block used for a pointer adopted together with a deleter of type D
+//
+// Deleters that need a different kind of control block specialize it (see deferred_reclamation.h).
+template<typename Counters, typename Ptr, typename D, typename A = default_state_allocator<std::remove_pointer_t<Ptr>>>
+struct state_selector {
+  using type = state<Counters, Ptr, D, A>;
+};
+
+template<typename Counters, typename Ptr, typename D, typename A = default_state_allocator<std::remove_pointer_t<Ptr>>>
+using state_t = typename state_selector<Counters, Ptr, D, A>::type;
+
+template<typename Counters, typename T, typename A = std::allocator<T>>
+class inline_state final : public state_base<Counters>, private ebo_helper<A, 1> {
+  using ABase = ebo_helper<A, 1>;
+  std::aligned_storage_t<sizeof(T), alignof(T)> storage_;
+  A& allocator() { return static_cast<ABase&>(*this).get(); }
+
+  static void release_ptr(state_base<Counters>& base) noexcept
+  {
+    inline_state& self = static_cast<inline_state&>(base);
+    std::allocator_traits<A>::destroy(self.allocator(), self.ptr());
+  }
+  static void destroy(state_base<Counters>& base) noexcept
+  {
+    inline_state& self = static_cast<inline_state&>(base);
+    allocator_type alloc{self.allocator()};
+    using alloc_traits = std::allocator_traits<allocator_type>;
+    alloc_guard<allocator_type> guard{alloc, &self};
+    alloc_traits::destroy(alloc, &self);
+  }
+  static void release_ptr_and_destroy(state_base<Counters>& base) noexcept
+  {
+    release_ptr(base);
+    destroy(base);
+  }
+  static constexpr state_ops<Counters> ops{&release_ptr, &destroy, &release_ptr_and_destroy};
+
+  // trivially destructible objects allocated with std::allocator do not need any operations
+  static constexpr bool trivial = std::is_same<A, std::allocator<T>>::value &&
+                                  std::is_trivially_destructible<T>::value &&
+                                  std::is_trivially_destructible<Counters>::value &&
+                                  alignof(T) <= alignof(std::max_align_t);
+
+public:
+  using allocator_type = typename std::allocator_traits<A>::template rebind_alloc<inline_state>;
+  template<typename... Args>
+  explicit inline_state(const A& a, Args&&... args) : state_base<Counters>{trivial ? nullptr : &ops}, ABase{a}
+  {
+    std::allocator_traits<A>::construct(allocator(), ptr(), std::forward<Args>(args)...);
+    this->template track<T*>();
+  }
+
+  T* ptr() noexcept { return reinterpret_cast<T*>(&storage_); }
+};
+
+template<typename Counters, typename T, typename A>
+constexpr state_ops<Counters> inline_state<Counters, T, A>::ops;
+
+// Array elements stored right after the control block
+//
+// Elements start at a boundary suitable for aligned SIMD loads. The control block keeps the number of
+// (innermost) elements to be able to destroy them and to compute the size of the allocation.
+constexpr std::size_t simd_alignment = 64;
+
+template<typename Counters, typename T, typename A = std::allocator<T>>
+class array_state final : public state_base<Counters>, private ebo_helper<A, 1> {
+  using ABase = ebo_helper<A, 1>;
+  using alloc_traits = std::allocator_traits<A>;
+  using byte_allocator = typename alloc_traits::template rebind_alloc<unsigned char>;
+  using byte_traits = std::allocator_traits<byte_allocator>;
+
+  static constexpr std::size_t alignment = alignof(T) > simd_alignment ? alignof(T) : simd_alignment;
+  std::size_t size_;
+
+  A& allocator() { return static_cast<ABase&>(*this).get(); }
+
+  static std::size_t allocation_size(std::size_t size) noexcept
+  {
+    return sizeof(array_state) + alignment - 1 + size * sizeof(T);
+  }
+
+  void destroy_elements(std::size_t count) noexcept
+  {
+    T* first = data();
+    while(count > 0) {
+      alloc_traits::destroy(allocator(), first + --count);
+    }
+  }
+
+  static void release_ptr(state_base<Counters>& base) noexcept
+  {
+    array_state& self = static_cast<array_state&>(base);
+    self.destroy_elements(self.size_);
+  }
+  static void destroy(state_base<Counters>& base) noexcept
+  {
+    array_state& self = static_cast<array_state&>(base);
+    byte_allocator alloc{self.allocator()};
+    const std::size_t size = allocation_size(self.size_);
+    self.~array_state();
+    byte_traits::deallocate(alloc, reinterpret_cast<unsigned char*>(&self), size);
+  }
+  static void release_ptr_and_destroy(state_base<Counters>& base) noexcept
+  {
+    release_ptr(base);
+    destroy(base);
+  }
+  static constexpr state_ops<Counters> ops{&release_ptr, &destroy, &release_ptr_and_destroy};
+
+  array_state(const A& a, std::size_t size) noexcept : state_base<Counters>{&ops}, ABase{a}, size_{size} {}
+
+  static void construct(A& a, T* ptr, std::size_t) { alloc_traits::construct(a, ptr); }
+  static void construct(A& a, T* ptr, std::size_t i, const T* init) { alloc_traits::construct(a, ptr, init[i]); }
+
+public:
+  // constructs size elements, value-initialized or copied cyclically from init[0..init_size)
+  template<typename... Init>
+  static array_state* create(const A& a, std::size_t size, std::size_t init_size, const Init*... init)
+  {
+    if(size > (std::numeric_limits<std::size_t>::max() - sizeof(array_state) - alignment) / sizeof(T)) {
+      throw std::bad_array_new_length{};
+    }
+    byte_allocator bytes{a};
+    const std::size_t bytes_size = allocation_size(size);
+    array_state* self = ::new(byte_traits::allocate(bytes, bytes_size)) array_state{a, size};
+    hooks::allocation();
+    T* first = self->data();
+    std::size_t i = 0;
+    try {
+      for(; i < size; ++i) {
+        construct(self->allocator(), first + i, i % init_size, init...);
+      }
+    }
+    catch(...) {
+      self->destroy_elements(i);
+      self->~array_state();
+      byte_traits::deallocate(bytes, reinterpret_cast<unsigned char*>(self), bytes_size);
+      throw;
+    }
+    self->template track<T*>();
+    return self;
+  }
+
+  T* data() noexcept
+  {
+    const std::uintptr_t end = reinterpret_cast<std::uintptr_t>(this) + sizeof(array_state);
+    return reinterpret_cast<T*>((end + alignment - 1) & ~std::uintptr_t{alignment - 1});
+  }
+};
+
+template<typename Counters, typename T, typename A>
+constexpr state_ops<Counters> array_state<Counters, T, A>::ops;
+
+template<typename State, typename A, typename... Args>
+State* allocate_state(const A& a, Args&&... args)
+{
+  using allocator_type = typename State::allocator_type;
+  using alloc_traits = std::allocator_traits<allocator_type>;
+
+  allocator_type alloc{a};
+  State* buffer = alloc_traits::allocate(alloc, 1);
+  hooks::allocation();
+  alloc_guard<allocator_type> guard{alloc, buffer};
+  alloc_traits::construct(alloc, buffer, std::forward<Args>(args)...);
+  guard.release();
+  return buffer;
+}
+
+// allocates a control block with a default constructed allocator
+template<typename State, typename... Args>
+State* new_state(Args&&... args)
+{
+  return allocate_state<State>(typename State::allocator_type{}, std::forward<Args>(args)...);
+}
+
+// Y* is compatible with the stored pointer of shared_ptr<T> adopting it (Y(*)[] or Y(*)[N] for arrays)
+template<typename Y, typename T>
+struct adoptable : std::is_convertible<Y*, T*> {};
+template<typename Y, typename U>
+struct adoptable<Y, U[]> : std::is_convertible<Y (*)[], U (*)[]> {};
+template<typename Y, typename U, std::size_t N>
+struct adoptable<Y, U[N]> : std::is_convertible<Y (*)[N], U (*)[N]> {};
+
+// deleter used when shared_ptr<T> adopts Y* without a user provided one
+template<typename T, typename Y>
+using default_deleter_t = std::conditional_t<std::is_array<T>::value, std::default_delete<Y[]>, std::default_delete<Y>>;
+
+struct adopt_state_t {};
+constexpr adopt_state_t adopt_state{};
+
+template<typename Counters>
+class weak_state;
+struct atomic_access;
+struct batch_access;
+
+template<typename Counters>
+class shared_state {
+  friend class weak_state<Counters>;
+  friend struct atomic_access;
+  state_base<Counters>* base_ = nullptr;
+public:
+  shared_state() = default;
+
+  // takes over a control block that already accounts for this owner
+  template<typename State>
+  shared_state(adopt_state_t, State* base) noexcept : base_{base} {}
+
+  template<typename Ptr>
+  explicit shared_state(Ptr p) try : base_{new_state<state<Counters, Ptr>>(p)}
+  {
+  }
+  catch(...) {
+    delete p;
+    throw;
+  }
+
+  template<typename Ptr, typename D>
+  shared_state(Ptr p, D&& d) try : base_{new_state<state_t<Counters, Ptr, D>>(p, std::forward<D>(d))}
+  {
+  }
+  catch(...) {
+    d(p);
+    throw;
+  }
+
+  template<typename Ptr, typename D, typename A>
+  shared_state(Ptr p, D&& d, A&& a) try
+  {
+    using state_type = state_t<Counters, Ptr, D, A>;
+    using alloc_traits = std::allocator_traits<typename state_type::allocator_type>;
+
+    typename state_type::allocator_type alloc{a};
+    state_type* buffer = alloc_traits::allocate(alloc, 1);
+    hooks::allocation();
+    alloc_guard<typename state_type::allocator_type> guard{alloc, buffer};
+    alloc_traits::construct(alloc, buffer, p, std::forward<D>(d), std::forward<A>(a));
+    guard.release();
+    base_ = buffer;
+  }
+  catch(...) {
+    d(p);
+    throw;
+  }
+
+  shared_state(const shared_state& other) noexcept : base_{other.base_}
+  {
+    if(base_) {
+      base_->add_shared();
+    }
+  }
+
+  shared_state(const weak_state<Counters>& other);
+  shared_state(const weak_state<Counters>& other, std::nothrow_t);
+
+  shared_state(shared_state&& other) noexcept : base_{other.base_}
+  {
+    other.base_ = nullptr;
+  }
+
+  shared_state& operator=(const shared_state& other) noexcept
+  {
+    if(other.base_) {
+      other.base_->add_shared();
+    }
+    if(base_) {
+      base_->release();
+    }
+    base_ = other.base_;
+    return *this;
+  }
+
+  shared_state& operator=(shared_state&& other) noexcept
+  {
+    if(this != &other) {
+      if(base_) {
+        base_->release();
+      }
+      base_ = other.base_;
+      other.base_ = nullptr;
+    }
+    return *this;
+  }
+
+  ~shared_state()
+  {
+    if(base_){
+      base_->release();
+    }
+  }
+
+  long use_count() const noexcept { return base_ ? base_->use_count() : 0; }
+  explicit operator bool() const noexcept { return base_ != nullptr; }
+
+  state_base<Counters>* get() const noexcept { return base_; }
+  // gives up the ownership without releasing it
+  state_base<Counters>* release() noexcept
+  {
+    state_base<Counters>* base = base_;
+    base_ = nullptr;
+    return base;
+  }
+};
+
+
+template<typename Counters>
+class weak_state {
+  friend class shared_state<Counters>;
+  state_base<Counters>* base_ = nullptr;
+public:
+  weak_state() = default;
+
+  // takes over a control block that already accounts for this weak reference
+  weak_state(adopt_state_t, state_base<Counters>* base) noexcept : base_{base} {}
+
+  weak_state(const weak_state& other) noexcept : base_{other.base_}
+  {
+    if(base_) {
+      base_->add_weak();
+    }
+  }
+
+  weak_state(const shared_state<Counters>& other) noexcept : base_{other.base_}
+  {
+    if(base_) {
+      base_->add_weak();
+    }
+  }
+
+  weak_state(weak_state&& other) noexcept : base_{other.base_}
+  {
+    other.base_ = nullptr;
+  }
+
+  weak_state& operator=(const weak_state& other) noexcept
+  {
+    if(other.base_) {
+      other.base_->add_weak();
+    }
+    if(base_) {
+      base_->weak_release();
+    }
+    base_ = other.base_;
+    return *this;
+  }
+
+  weak_state& operator=(const shared_state<Counters>& other) noexcept
+  {
+    if(other.base_) {
+      other.base_->add_weak();
+    }
+    if(base_) {
+      base_->weak_release();
+    }
+    base_ = other.base_;
+    return *this;
+  }
+
+  weak_state& operator=(weak_state&& other) noexcept
+  {
+    if(base_) {
+      base_->weak_release();
+    }
+    base_ = other.base_;
+    other.base_ = nullptr;
+    return *this;
+  }
+
+  ~weak_state()
+  {
+    if(base_){
+      base_->weak_release();
+    }
+  }
+
+  long use_count() const noexcept { return base_ ? base_->use_count() : 0; }
+  bool expired() const noexcept { return use_count() == 0; }
+
+  state_base<Counters>* get() const noexcept { return base_; }
+};
+
+
+template<typename Counters>
+shared_state<Counters>::shared_state(const weak_state<Counters>& other) : base_{other.base_}
+{
+  if(!base_ || !base_->try_add_shared()) {
+    throw std::bad_weak_ptr{};
+  }
+}
+
+template<typename Counters>
+shared_state<Counters>::shared_state(const weak_state<Counters>& other, std::nothrow_t) : base_{other.base_}
+{
+  if(base_ && !base_->try_add_shared()) {
+    base_ = nullptr;
+  }
+}
+
+// Control block embedded in an object deriving from embedded_shared_from_this
+//
+// Its operations are set when the object is adopted by its first owner. Until then it has no owners.
+template<typename Counters>
+class embedded_state : public state_base<Counters> {
+  static_assert(std::is_trivially_destructible<Counters>::value,
+                "counters are still used after the destruction of the object that embeds them");
+
+public:
+  embedded_state() noexcept : state_base<Counters>{nullptr} {}
+
+  bool adopted() const noexcept { return this->ops() != nullptr; }
+  template<typename Ptr>
+  void adopt(const state_ops<Counters>* ops) noexcept
+  {
+    this->set_ops(ops);
+    this->template track<Ptr>();
+  }
+};
+
+template<typename Counters, typename U, typename Y>
+struct embedded_ops;
+
+}
+
+// Reference counting policy of shared_ptr and weak_ptr that store only a pointer to an object with
+// embedded counters (see intrusive_ref_base). It is always selected explicitly, e.g. with intrusive_ptr,
+// so that the type of a pointer does not depend on whether its pointee is complete yet.
+template<typename Counters = atomic_counters>
+struct intrusive {};
+
+namespace detail {
+
+template<typename Counters>
+struct is_intrusive : std::false_type {};
+template<typename Counters>
+struct is_intrusive<intrusive<Counters>> : std::true_type {};
+
+}
+
+template <typename T, typename Counters = atomic_counters>
+class shared_ptr;
+
+template <typename T, typename Counters = atomic_counters>
+class enable_shared_from_this;
+
+template <typename T, typename Counters = atomic_counters>
+class embedded_shared_from_this;
+
+template <typename T, typename Counters = atomic_counters>
+class intrusive_ref_base;
+
+template <typename T, typename Counters = atomic_counters>
+class thin_shared_ptr;
+
+template <typename T, typename Counters = atomic_counters>
+class thin_weak_ptr;
+
+template <typename T, typename Counters = atomic_counters>
+class unique_shareable_ptr;
+
+template <typename T, typename Counters = atomic_counters>
+class borrowed_ptr;
+
+namespace detail {
+
+template<typename T, typename Counters>
+struct shared_factory;
+
+// true if T derives from embedded_shared_from_this with the given counters
+template<typename Counters, typename U>
+std::true_type embeds_state(const embedded_shared_from_this<U, Counters>*);
+template<typename Counters>
+std::false_type embeds_state(const void*);
+template<typename T, typename Counters>
+using has_embedded_state = decltype(embeds_state<Counters>(std::declval<T*>()));
+
+// Gives intrusive pointers access to the control block embedded in the object they point to
+struct embedded_access {
+  template<typename U, typename Counters>
+  static embedded_state<Counters>& state(const embedded_shared_from_this<U, Counters>& obj) noexcept
+  {
+    return obj.state();
+  }
+
+  template<typename Y, typename U, typename Counters>
+  static void adopt(Y* p, const embedded_shared_from_this<U, Counters>&) noexcept
+  {
+    using object_type = std::remove_cv_t<Y>;
+    embedded_ops<Counters, U, object_type>::adopt(const_cast<object_type*>(p));
+  }
+};
+
+}
+
+template <typename T, typename Counters = atomic_counters>
+class weak_ptr {
+  template<typename U>
+  using Convertible = std::enable_if_t<std::is_convertible<U, T*>::value>;
+
+  std::remove_extent_t<T>* ptr_ = nullptr;
+  detail::weak_state<Counters> state_;
+
+  template<typename U, typename C> friend class weak_ptr;
+  template<typename U, typename C> friend class shared_ptr;
+  template<typename U, typename C> friend class embedded_shared_from_this;
+  template<typename U, typename C> friend class thin_shared_ptr;
+  template<typename U, typename C> friend class thin_weak_ptr;
+
+public:
+  using element_type = std::remove_extent_t<T>;
+
+// 20.11.2.3.1, constructors
+  constexpr weak_ptr() noexcept = default;
+
+  // lock() is needed in case of converting operation. r.ptr_ may already
+  // have been invalidated in multithreaded application. The ptr_(r.ptr_)
+  // conversion may require access to *r.ptr_ (virtual inheritance).
+  template<class Y, typename = Convertible<Y*>>
+  weak_ptr(const shared_ptr<Y, Counters>& r) noexcept : ptr_{r.ptr_}, state_{r.state_}
+  {
+  }
+
+  weak_ptr(weak_ptr const& r) noexcept = default;
+
+  template<class Y, typename = Convertible<Y*>>
+  weak_ptr(const weak_ptr<Y, Counters>& r) noexcept : ptr_{r.lock().get()}, state_{r.state_}
+  {
+  }
+
+  weak_ptr(weak_ptr&& r) noexcept : ptr_{std::move(r.ptr_)}, state_{std::move(r.state_)}
+  {
+    r.ptr_ = nullptr;
+  }
+
+  template<class Y, typename = Convertible<Y*>>
+  weak_ptr(weak_ptr<Y, Counters>&& r) noexcept : ptr_{r.lock().get()}, state_{std::move(r.state_)}
+  {
+    r.ptr_ = nullptr;
+  }
+
+// 20.11.2.3.2, destructor
+  ~weak_ptr() = default;
+
+// 20.11.2.3.3, assignment
+  weak_ptr& operator=(const weak_ptr& r) noexcept
+  {
+    ptr_ = r.ptr_;
+    state_ = r.state_;
+    return *this;
+  }
+  template<class Y> weak_ptr& operator=(const weak_ptr<Y, Counters>& r) noexcept
+  {
+    ptr_ = r.lock().get();
+    state_ = r.state_;
+    return *this;
+  }
+
+  template<class Y> weak_ptr& operator=(const shared_ptr<Y, Counters>& r) noexcept
+  {
+    ptr_ = r.ptr_;
+    state_ = r.state_;
+    return *this;
+  }
+  weak_ptr& operator=(weak_ptr&& r) noexcept
+  {
+    ptr_ = r.ptr_;
+    state_ = std::move(r.state_);
+    r.ptr_ = nullptr;
+    return *this;
+  }
+  template<class Y> weak_ptr& operator=(weak_ptr<Y, Counters>&& r) noexcept
+  {
+    ptr_ = r.lock().get();
+    state_ = std::move(r.state_);
+    r.ptr_ = nullptr;
+    return *this;
+  }
+
+  // 20.11.2.3.4, modifiers
+  void swap(weak_ptr& r) noexcept
+  {
+    using std::swap;
+    swap(state_, r.state_);
+    swap(ptr_, r.ptr_);
+  }
+  void reset() noexcept { weak_ptr{}.swap(*this); }
+// 20.11.2.3.5, observers
+  long use_count() const noexcept { return state_.use_count(); }
+  bool expired() const noexcept { return state_.expired(); }
+  shared_ptr<T, Counters> lock() const noexcept { return shared_ptr<T, Counters>(*this, std::nothrow); }
+  template<class U> bool owner_before(const shared_ptr<U, Counters>& b) const noexcept
+  {
+    return std::less<const void*>{}(owner(), b.owner());
+  }
+  template<class U> bool owner_before(const weak_ptr<U, Counters>& b) const noexcept
+  {
+    return std::less<const void*>{}(owner(), b.owner());
+  }
+  std::size_t owner_hash() const noexcept { return detail::hash_pointer(owner()); }
+  template<class U> bool owner_equal(const shared_ptr<U, Counters>& b) const noexcept { return owner() == b.owner(); }
+  template<class U> bool owner_equal(const weak_ptr<U, Counters>& b) const noexcept { return owner() == b.owner(); }
+
+private:
+  // pointers share the ownership if they use the same control block
+  const void* owner() const noexcept { return state_.get(); }
+};
+
+// 20.11.2.3.6, specialized algorithms
+template<class T, class Counters> void swap(weak_ptr<T, Counters>& a, weak_ptr<T, Counters>& b) noexcept
+{
+  a.swap(b);
+}
+
+
+template <class T, class Counters>
+class shared_ptr {
+  template<typename U>
+  using Convertible = std::enable_if_t<std::is_convertible<U, T*>::value>;
+
+  std::remove_extent_t<T>* ptr_ = nullptr;
+  detail::shared_state<Counters> state_;
+
+  template<typename U, typename C> friend class shared_ptr;
+  template<typename U, typename C> friend class weak_ptr;
+  template<typename U, typename C> friend struct detail::shared_factory;
+  friend struct detail::atomic_access;
+  friend struct detail::batch_access;
+  template<typename U, typename C> friend class embedded_shared_from_this;
+  template<typename U, typename C> friend class thin_shared_ptr;
+  template<typename U, typename C> friend class thin_weak_ptr;
+  template<typename U, typename C> friend class unique_shareable_ptr;
+  template<typename U, typename C> friend class borrowed_ptr;
+
+  shared_ptr(detail::shared_state<Counters>&& state, std::remove_extent_t<T>* p) noexcept
+      : ptr_{p}, state_{std::move(state)}
+  {
+  }
+
+  // objects deriving from embedded_shared_from_this bring their own control block
+  template <class Y>
+  static detail::shared_state<Counters> adopt(Y* p)
+  {
+    // elements of arrays are never adopted on their own
+    return adopt(static_cast<std::conditional_t<std::is_array<T>::value, const void*, Y*>>(p), p);
+  }
+  template <class U, class Y>
+  static detail::shared_state<Counters> adopt(const embedded_shared_from_this<U, Counters>* e, Y* p)
+  {
+    if(!e) {
+      return detail::shared_state<Counters>{p, detail::default_deleter_t<T, Y>{}};
+    }
+    return detail::shared_state<Counters>{detail::adopt_state, detail::embedded_ops<Counters, U, Y>::adopt(p)};
+  }
+  template <class Y>
+  static detail::shared_state<Counters> adopt(const void*, Y* p)
+  {
+    return detail::shared_state<Counters>{p, detail::default_deleter_t<T, Y>{}};
+  }
+
+  // the embedded control block can take over only a deleter that it would use anyway
+  template <class Y, class D, class... A>
+  static detail::shared_state<Counters> adopt_with_deleter(Y* p, D& d, A&... a)
+  {
+    using embedded = detail::has_embedded_state<Y, Counters>;
+    return adopt_with_deleter(std::integral_constant<bool, !std::is_array<T>::value && embedded::value>{}, p, d, a...);
+  }
+  template <class Y, class D, class... A>
+  static detail::shared_state<Counters> adopt_with_deleter(std::true_type, Y* p, D&, A&...)
+  {
+    static_assert(std::is_same<D, std::default_delete<Y>>::value,
+                  "objects with embedded counters are always freed with delete");
+    return adopt(p);
+  }
+  template <class Y, class D, class... A>
+  static detail::shared_state<Counters> adopt_with_deleter(std::false_type, Y* p, D& d, A&... a)
+  {
+    return detail::shared_state<Counters>{p, std::move(d), std::move(a)...};
+  }
+
+  // the control block embedded in an object is adopted only if the object would be freed with delete anyway
+  template <class U, class Y, class D>
+  static shared_ptr from_unique(const embedded_shared_from_this<U, Counters>*, std::unique_ptr<Y, D>& r)
+  {
+    static_assert(std::is_same<std::remove_cv_t<std::remove_reference_t<D>>, std::default_delete<Y>>::value,
+                  "objects with embedded counters are always freed with delete");
+    return shared_ptr{r.release()};
+  }
+  template <class Y, class D>
+  static shared_ptr from_unique(const void*, std::unique_ptr<Y, D>& r)
+  {
+    if(std::is_reference<D>::value) {
+      return shared_ptr{r.release(), std::ref(r.get_deleter())};
+    }
+    return shared_ptr{r.release(), r.get_deleter()};
+  }
+
+  // objects deriving from enable_shared_from_this learn about their first owner
+  template <class Y>
+  void enable_weak_this(Y* p) noexcept
+  {
+    if(!std::is_array<T>::value) {
+      enable_weak_this(p, p);
+    }
+  }
+  template <class U, class Y>
+  void enable_weak_this(const enable_shared_from_this<U, Counters>* e, Y* p) noexcept
+  {
+    if(e && e->weak_this_.expired()) {
+      e->weak_this_.ptr_ = const_cast<std::remove_cv_t<Y>*>(p);
+      e->weak_this_.state_ = state_;
+    }
+  }
+  void enable_weak_this(const void*, const void*) noexcept {}
+
+  template <class Y>
+  explicit shared_ptr(const weak_ptr<Y, Counters>& r, std::nothrow_t) : state_{r.state_, std::nothrow}
+  {
+    if(state_) {
+      ptr_ = r.ptr_;
+    }
+    static_assert(std::is_convertible<Y*, T*>::value, "Y shall be convertible to T*");
+  }
+
+public:
+  using element_type = std::remove_extent_t<T>;
+  using weak_type = weak_ptr<T, Counters>;
+
+  // 20.11.2.2.1, constructors:
+  constexpr shared_ptr() noexcept = default;
+
+  template <class Y>
+  explicit shared_ptr(Y* p) : ptr_{p}, state_{adopt(p)}
+  {
+    static_assert(detail::adoptable<Y, T>::value, "p shall be convertible to T*");
+    static_assert(!std::is_void<Y>::value, "Y shall be a complete type" );
+    static_assert(sizeof(Y) > 0, "Y shall be a complete type" );
+    static_assert(std::is_nothrow_destructible<decltype(p)>::value,
+                  "The expression delete p shall not throw exceptions");
+
+    enable_weak_this(p);
+  }
+
+  template <class Y, class D>
+  shared_ptr(Y* p, D d) : ptr_{p}, state_{adopt_with_deleter(p, d)}
+  {
+    static_assert(detail::adoptable<Y, T>::value, "p shall be convertible to T*");
+    static_assert(std::is_copy_constructible<D>::value,
+                  "D shall be CopyConstructible and such construction shall not throw exceptions");
+//  static_assert(std::is_nothrow_copy_constructible(D),
+//                "D shall be CopyConstructible and such construction shall not throw exceptions");
+    static_assert(std::is_nothrow_destructible<D>::value, "The destructor of D shall not throw exceptions");
+
+    enable_weak_this(p);
+  }
+
+  template <class Y, class D, class A>
+  shared_ptr(Y* p, D d, A a) : ptr_{p}, state_{adopt_with_deleter(p, d, a)}
+  {
+    static_assert(detail::adoptable<Y, T>::value, "p shall be convertible to T*");
+    static_assert(std::is_copy_constructible<D>::value,
+                  "D shall be CopyConstructible "
+                  "and such construction shall "
+                  "not throw exceptions");
+    // static_assert(std::is_nothrow_copy_constructible(D), "D shall be
+    // CopyConstructible and such construction shall not throw exceptions");
+    static_assert(std::is_nothrow_destructible<D>::value, "The destructor of D shall not throw exceptions");
+    static_assert(std::is_copy_constructible<A>::value,
+                  "A shall be CopyConstructible "
+                  "and such construction shall "
+                  "not throw exceptions");
+    //            static_assert(std::is_nothrow_copy_constructible(A), "A shall
+    //            be CopyConstructible and such construction shall not throw
+    //            exceptions");
+    static_assert(std::is_nothrow_destructible<A>::value, "The destructor of A shall not throw exceptions");
+
+    enable_weak_this(p);
+  }
+
+  template <class D>
+  shared_ptr(std::nullptr_t p, D d) : ptr_{p}, state_{p, std::move(d)}
+  {
+    static_assert(std::is_copy_constructible<D>::value,
+                  "D shall be CopyConstructible "
+                  "and such construction shall "
+                  "not throw exceptions");
+    // static_assert(std::is_nothrow_copy_constructible(D), "D shall be
+    // CopyConstructible and such construction shall not throw exceptions");
+    static_assert(std::is_nothrow_destructible<D>::value, "The destructor of D shall not throw exceptions");
+
+  }
+
+  template <class D, class A>
+  shared_ptr(std::nullptr_t p, D d, A a) : ptr_{p}, state_{p, std::move(d), std::move(a)}
+  {
+    static_assert(std::is_copy_constructible<D>::value,
+                  "D shall be CopyConstructible "
+                  "and such construction shall "
+                  "not throw exceptions");
+    // static_assert(std::is_nothrow_copy_constructible(D), "D shall be
+    // CopyConstructible and such construction shall not throw exceptions");
+    static_assert(std::is_nothrow_destructible<D>::value, "The destructor of D shall not throw exceptions");
+    static_assert(std::is_copy_constructible<A>::value,
+                  "A shall be CopyConstructible "
+                  "and such construction shall "
+                  "not throw exceptions");
+    //            static_assert(std::is_nothrow_copy_constructible(A), "A shall
+    //            be CopyConstructible and such construction shall not throw
+    //            exceptions");
+    static_assert(std::is_nothrow_destructible<A>::value, "The destructor of A shall not throw exceptions");
+  }
+
+  template <class Y>
+  shared_ptr(const shared_ptr<Y, Counters>& r, element_type* p) noexcept : ptr_{p}, state_{r.state_}
+  {
+  }
+
+  shared_ptr(const shared_ptr& r) noexcept = default;
+
+  template <class Y, typename = Convertible<Y*>>
+  shared_ptr(const shared_ptr<Y, Counters>& r) noexcept : ptr_{r.ptr_}, state_{r.state_}
+  {
+  }
+
+  shared_ptr(shared_ptr&& r) noexcept : ptr_{std::move(r.ptr_)}, state_{std::move(r.state_)}
   {
-    ptr_ = r.ptr_;
-    state_ = std::move(r.state_);
     r.ptr_ = nullptr;
+  }
+
+  template <class Y, typename = Convertible<Y*>>
+  shared_ptr(shared_ptr<Y, Counters>&& r) noexcept : ptr_{std::move(r.ptr_)}, state_{std::move(r.state_)}
+  {
+    r.ptr_ = nullptr;
+  }
+
+  template <class Y>
+  explicit shared_ptr(const weak_ptr<Y, Counters>& r) : ptr_{r.ptr_}, state_{r.state_}
+  {
+    static_assert(std::is_convertible<Y*, T*>::value, "Y shall be convertible to T*");
+  }
+
+  template <class Y, class D, typename = std::enable_if_t<
+                                  std::is_convertible<typename std::unique_ptr<Y, D>::pointer, element_type*>::value>>
+  shared_ptr(std::unique_ptr<Y, D>&& r)
+  {
+    if(r.get()) {
+      *this = from_unique(static_cast<std::conditional_t<std::is_array<T>::value, const void*, Y*>>(r.get()), r);
+    }
+  }
+
+  constexpr shared_ptr(std::nullptr_t) noexcept : shared_ptr() {}
+
+  // 20.11.2.2.2, destructor:
+  ~shared_ptr() = default;
+
+  // 20.11.2.2.3, assignment:
+  shared_ptr& operator=(const shared_ptr& r) noexcept = default;
+  template <class Y>
+  shared_ptr& operator=(const shared_ptr<Y, Counters>& r) noexcept;
+  shared_ptr& operator=(shared_ptr&& r) noexcept = default;
+  template <class Y>
+  shared_ptr& operator=(shared_ptr<Y, Counters>&& r) noexcept;
+  template <class Y, class D>
+  shared_ptr& operator=(std::unique_ptr<Y, D>&& r);
+  // 20.11.2.2.4, modifiers:
+  void swap(shared_ptr& r) noexcept
+  {
+    using std::swap;
+    swap(state_, r.state_);
+    swap(ptr_, r.ptr_);
+  }
+  void reset() noexcept;
+  template <class Y>
+  void reset(Y* p);
+  template <class Y, class D>
+  void reset(Y* p, D d);
+  template <class Y, class D, class A>
+  void reset(Y* p, D d, A a);
+  // 20.11.2.2.5, observers:
+  element_type* get() const noexcept { return ptr_; }
+  T& operator*() const noexcept { return *ptr_; }
+  T* operator->() const noexcept { return ptr_; }
+  template <class U = T, typename = std::enable_if_t<std::is_array<U>::value>>
+  element_type& operator[](std::ptrdiff_t i) const noexcept
+  {
+    return ptr_[i];
+  }
+  long use_count() const noexcept { return state_.use_count(); }
+  bool unique() const noexcept { return use_count() == 1; }
+  explicit operator bool() const noexcept { return get() != nullptr; }
+  template<class U> bool owner_before(const shared_ptr<U, Counters>& b) const noexcept
+  {
+    return std::less<const void*>{}(owner(), b.owner());
+  }
+  template<class U> bool owner_before(const weak_ptr<U, Counters>& b) const noexcept
+  {
+    return std::less<const void*>{}(owner(), b.owner());
+  }
+  std::size_t owner_hash() const noexcept { return detail::hash_pointer(owner()); }
+  template<class U> bool owner_equal(const shared_ptr<U, Counters>& b) const noexcept { return owner() == b.owner(); }
+  template<class U> bool owner_equal(const weak_ptr<U, Counters>& b) const noexcept { return owner() == b.owner(); }
+
+private:
+  // pointers share the ownership if they use the same control block
+  const void* owner() const noexcept { return state_.get(); }
+};
+
+// 20.11.2.5, class template enable_shared_from_this
+template <class T, class Counters>
+class enable_shared_from_this {
+  template<typename U, typename C> friend class shared_ptr;
+  mutable weak_ptr<T, Counters> weak_this_;
+
+protected:
+  constexpr enable_shared_from_this() noexcept = default;
+  enable_shared_from_this(const enable_shared_from_this&) noexcept {}
+  enable_shared_from_this& operator=(const enable_shared_from_this&) noexcept { return *this; }
+  ~enable_shared_from_this() = default;
+
+public:
+  shared_ptr<T, Counters> shared_from_this() { return shared_ptr<T, Counters>{weak_this_}; }
+  shared_ptr<const T, Counters> shared_from_this() const { return shared_ptr<const T, Counters>{weak_this_}; }
+  weak_ptr<T, Counters> weak_from_this() noexcept { return weak_this_; }
+  weak_ptr<const T, Counters> weak_from_this() const noexcept { return weak_this_; }
+};
+
+// enable_shared_from_this with the control block embedded in the object
+//
+// Adopting a raw pointer to such an object does not allocate anything and shared_from_this() does not
+// have to go through a weak_ptr. Adopting it again while it has owners shares the same control block.
+// The object must come from a new expression of the type it is adopted as, so a polymorphic type has to
+// be final. It is destroyed when its last owner goes away but its memory is freed only after the last
+// weak_ptr to it is gone, with the operator delete a delete expression would use.
+template <class T, class Counters>
+class embedded_shared_from_this : private detail::embedded_state<Counters> {
+  template<typename C, typename U, typename Y> friend struct detail::embedded_ops;
+  friend struct detail::embedded_access;
+
+  // the counters are not a part of the logical state of the object
+  detail::embedded_state<Counters>& state() const noexcept { return const_cast<embedded_shared_from_this&>(*this); }
+
+  template<typename U>
+  shared_ptr<U, Counters> shared_from(U* p) const
+  {
+    detail::embedded_state<Counters>& base = state();
+    if(!base.adopted() || !base.try_add_shared()) {
+      throw std::bad_weak_ptr{};
+    }
+    return shared_ptr<U, Counters>{detail::shared_state<Counters>{detail::adopt_state, &base}, p};
+  }
+  template<typename U>
+  weak_ptr<U, Counters> weak_from(U* p) const noexcept
+  {
+    detail::embedded_state<Counters>& base = state();
+    weak_ptr<U, Counters> result;
+    if(base.adopted()) {
+      base.add_weak();
+      result.ptr_ = p;
+      result.state_ = detail::weak_state<Counters>{detail::adopt_state, &base};
+    }
+    return result;
+  }
+
+protected:
+  embedded_shared_from_this() noexcept = default;
+  embedded_shared_from_this(const embedded_shared_from_this&) noexcept : detail::embedded_state<Counters>{} {}
+  embedded_shared_from_this& operator=(const embedded_shared_from_this&) noexcept { return *this; }
+  ~embedded_shared_from_this() = default;
+
+public:
+  shared_ptr<T, Counters> shared_from_this() { return shared_from(static_cast<T*>(this)); }
+  shared_ptr<const T, Counters> shared_from_this() const { return shared_from(static_cast<const T*>(this)); }
+  weak_ptr<T, Counters> weak_from_this() noexcept { return weak_from(static_cast<T*>(this)); }
+  weak_ptr<const T, Counters> weak_from_this() const noexcept { return weak_from(static_cast<const T*>(this)); }
+};
+
+namespace detail {
+
+// overloads taking a higher priority win
+template<int N>
+struct priority : priority<N - 1> {};
+template<>
+struct priority<0> {};
+
+// Frees the memory of a destroyed object of the most derived type Y with the operator delete that a
+// delete expression would call
+template<typename Y>
+auto deallocate_object(void* p, priority<2>) noexcept -> decltype(Y::operator delete(p, sizeof(Y)))
+{
+  Y::operator delete(p, sizeof(Y));
+}
+template<typename Y>
+auto deallocate_object(void* p, priority<1>) noexcept -> decltype(Y::operator delete(p))
+{
+  Y::operator delete(p);
+}
+template<typename Y>
+void deallocate_object(void* p, priority<0>) noexcept
+{
+  ::operator delete(p);
+}
+
+// Operations of a control block embedded in an object of type Y deriving from embedded_shared_from_this<U>
+template<typename Counters, typename U, typename Y>
+struct embedded_ops {
+  static_assert(alignof(Y) <= alignof(std::max_align_t), "over-aligned objects are not freed with plain delete");
+  static_assert(!std::is_polymorphic<Y>::value || std::is_final<Y>::value,
+                "the memory is freed as an object of type Y so a polymorphic Y has to be final");
+
+  using base_type = embedded_shared_from_this<U, Counters>;
+  using object_type = std::remove_cv_t<Y>;
+
+  static object_type& object(state_base<Counters>& base) noexcept
+  {
+    return const_cast<object_type&>(
+        static_cast<Y&>(static_cast<base_type&>(static_cast<embedded_state<Counters>&>(base))));
+  }
+
+  static void release_ptr(state_base<Counters>& base) noexcept { object(base).~object_type(); }
+  static void destroy(state_base<Counters>& base) noexcept
+  {
+    deallocate_object<object_type>(&object(base), priority<2>{});
+  }
+  static void release_ptr_and_destroy(state_base<Counters>& base) noexcept
+  {
+    object_type* p = &object(base);
+    p->~object_type();
+    deallocate_object<object_type>(p, priority<2>{});
+  }
+  static constexpr state_ops<Counters> ops{&release_ptr, &destroy, &release_ptr_and_destroy};
+
+  // returns the control block accounting for the new owner
+  static state_base<Counters>* adopt(Y* p) noexcept
+  {
+    embedded_state<Counters>& s = static_cast<const base_type&>(*p).state();
+    if(s.adopted()) {
+      s.add_shared();
+    }
+    else {
+      s.template adopt<Y*>(&ops);
+    }
+    return &s;
+  }
+};
+
+template<typename Counters, typename U, typename Y>
+constexpr state_ops<Counters> embedded_ops<Counters, U, Y>::ops;
+
+}
+
+// Base class of objects owned by intrusive pointers
+//
+// intrusive_ptr<T> and intrusive_weak_ptr<T> of a type deriving from it hold nothing but a pointer to
+// the object as the counters live in the object header. Plain shared_ptr<T> adopts the same counters
+// but keeps the two-word layout. The rules of embedded_shared_from_this apply. In addition
+// the header is found with a static cast from the stored pointer even after the object is destroyed,
+// so intrusive_ref_base must not be a virtual base.
+template <class T, class Counters>
+class intrusive_ref_base : public embedded_shared_from_this<T, Counters> {
+  template<typename U>
+  shared_ptr<U, intrusive<Counters>> shared_from(U* p) const
+  {
+    detail::embedded_state<Counters>& base = detail::embedded_access::state(*this);
+    if(!base.adopted() || !base.try_add_shared()) {
+      throw std::bad_weak_ptr{};
+    }
+    return shared_ptr<U, intrusive<Counters>>{detail::adopt_state, p};
+  }
+  template<typename U>
+  weak_ptr<U, intrusive<Counters>> weak_from(U* p) const noexcept
+  {
+    detail::embedded_state<Counters>& base = detail::embedded_access::state(*this);
+    if(!base.adopted()) {
+      return {};
+    }
+    base.add_weak();
+    return weak_ptr<U, intrusive<Counters>>{detail::adopt_state, p};
+  }
+
+protected:
+  intrusive_ref_base() noexcept = default;
+  intrusive_ref_base(const intrusive_ref_base&) noexcept = default;
+  intrusive_ref_base& operator=(const intrusive_ref_base&) noexcept = default;
+  ~intrusive_ref_base() = default;
+
+public:
+  using intrusive_counters_type = Counters;
+
+  shared_ptr<T, intrusive<Counters>> shared_from_this() { return shared_from(static_cast<T*>(this)); }
+  shared_ptr<const T, intrusive<Counters>> shared_from_this() const { return shared_from(static_cast<const T*>(this)); }
+  weak_ptr<T, intrusive<Counters>> weak_from_this() noexcept { return weak_from(static_cast<T*>(this)); }
+  weak_ptr<const T, intrusive<Counters>> weak_from_this() const noexcept
+  {
+    return weak_from(static_cast<const T*>(this));
+  }
+};
+
+template <typename T, typename Counters = atomic_counters>
+using intrusive_ptr = shared_ptr<T, intrusive<Counters>>;
+
+template <typename T, typename Counters = atomic_counters>
+using intrusive_weak_ptr = weak_ptr<T, intrusive<Counters>>;
+
+// Intrusive weak_ptr
+//
+// The memory of the object is kept until the last weak reference is gone, so the weak counter
+// embedded in it stays reachable.
+template <class T, class Counters>
+class weak_ptr<T, intrusive<Counters>> {
+  template<typename U>
+  using Convertible = std::enable_if_t<std::is_convertible<U, T*>::value>;
+
+  T* ptr_ = nullptr;
+
+  template<typename U, typename C> friend class weak_ptr;
+  template<typename U, typename C> friend class shared_ptr;
+  template<typename U, typename C> friend class intrusive_ref_base;
+
+  static detail::state_base<Counters>& state(T* p) noexcept { return detail::embedded_access::state(*p); }
+
+  // takes over a weak reference that is already accounted for
+  weak_ptr(detail::adopt_state_t, T* p) noexcept : ptr_{p} {}
+
+public:
+  using element_type = T;
+
+  constexpr weak_ptr() noexcept = default;
+
+  template<class Y, typename = Convertible<Y*>>
+  weak_ptr(const shared_ptr<Y, intrusive<Counters>>& r) noexcept : ptr_{r.ptr_}
+  {
+    if(ptr_) {
+      state(ptr_).add_weak();
+    }
+  }
+
+  weak_ptr(const weak_ptr& r) noexcept : ptr_{r.ptr_}
+  {
+    if(ptr_) {
+      state(ptr_).add_weak();
+    }
+  }
+
+  // the object may already be destroyed but the pointer conversion does not touch it
+  template<class Y, typename = Convertible<Y*>>
+  weak_ptr(const weak_ptr<Y, intrusive<Counters>>& r) noexcept : ptr_{r.ptr_}
+  {
+    if(ptr_) {
+      state(ptr_).add_weak();
+    }
+  }
+
+  weak_ptr(weak_ptr&& r) noexcept : ptr_{r.ptr_} { r.ptr_ = nullptr; }
+
+  template<class Y, typename = Convertible<Y*>>
+  weak_ptr(weak_ptr<Y, intrusive<Counters>>&& r) noexcept : ptr_{r.ptr_}
+  {
+    r.ptr_ = nullptr;
+  }
+
+  ~weak_ptr()
+  {
+    if(ptr_) {
+      state(ptr_).weak_release();
+    }
+  }
+
+  weak_ptr& operator=(const weak_ptr& r) noexcept
+  {
+    weak_ptr{r}.swap(*this);
+    return *this;
+  }
+  template<class Y> weak_ptr& operator=(const weak_ptr<Y, intrusive<Counters>>& r) noexcept
+  {
+    weak_ptr{r}.swap(*this);
+    return *this;
+  }
+  template<class Y> weak_ptr& operator=(const shared_ptr<Y, intrusive<Counters>>& r) noexcept
+  {
+    weak_ptr{r}.swap(*this);
+    return *this;
+  }
+  weak_ptr& operator=(weak_ptr&& r) noexcept
+  {
+    weak_ptr{std::move(r)}.swap(*this);
+    return *this;
+  }
+  template<class Y> weak_ptr& operator=(weak_ptr<Y, intrusive<Counters>>&& r) noexcept
+  {
+    weak_ptr{std::move(r)}.swap(*this);
+    return *this;
+  }
+
+  void swap(weak_ptr& r) noexcept { std::swap(ptr_, r.ptr_); }
+  void reset() noexcept { weak_ptr{}.swap(*this); }
+
+  long use_count() const noexcept { return ptr_ ? state(ptr_).use_count() : 0; }
+  bool expired() const noexcept { return use_count() == 0; }
+  shared_ptr<T, intrusive<Counters>> lock() const noexcept
+  {
+    if(ptr_ && state(ptr_).try_add_shared()) {
+      return shared_ptr<T, intrusive<Counters>>{detail::adopt_state, ptr_};
+    }
+    return {};
+  }
+  template<class U> bool owner_before(const shared_ptr<U, intrusive<Counters>>& b) const noexcept
+  {
+    return std::less<const void*>{}(owner(), b.owner());
+  }
+  template<class U> bool owner_before(const weak_ptr<U, intrusive<Counters>>& b) const noexcept
+  {
+    return std::less<const void*>{}(owner(), b.owner());
+  }
+  std::size_t owner_hash() const noexcept { return detail::hash_pointer(owner()); }
+  template<class U> bool owner_equal(const shared_ptr<U, intrusive<Counters>>& b) const noexcept { return owner() == b.owner(); }
+  template<class U> bool owner_equal(const weak_ptr<U, intrusive<Counters>>& b) const noexcept { return owner() == b.owner(); }
+
+private:
+  // the control block embedded in the object identifies the owner no matter which base is pointed to
+  const void* owner() const noexcept { return ptr_ ? &state(ptr_) : nullptr; }
+};
+
+// Intrusive shared_ptr
+//
+// Raw pointers are adopted without any allocation and the same object may be adopted again while it has
+// owners. Custom deleters and allocators are not supported as the object is always freed with delete.
+template <class T, class Counters>
+class shared_ptr<T, intrusive<Counters>> {
+  template<typename U>
+  using Convertible = std::enable_if_t<std::is_convertible<U, T*>::value>;
+
+  T* ptr_ = nullptr;
+
+  template<typename U, typename C> friend class shared_ptr;
+  template<typename U, typename C> friend class weak_ptr;
+  template<typename U, typename C> friend class intrusive_ref_base;
+
+  static detail::state_base<Counters>& state(T* p) noexcept { return detail::embedded_access::state(*p); }
+
+  // takes over an owner that is already accounted for
+  shared_ptr(detail::adopt_state_t, T* p) noexcept : ptr_{p} {}
+
+public:
+  using element_type = T;
+  using weak_type = weak_ptr<T, intrusive<Counters>>;
+
+  constexpr shared_ptr() noexcept = default;
+  constexpr shared_ptr(std::nullptr_t) noexcept {}
+
+  template <class Y>
+  explicit shared_ptr(Y* p) noexcept : ptr_{p}
+  {
+    static_assert(std::is_convertible<Y*, T*>::value, "p shall be convertible to T*");
+    if(p) {
+      detail::embedded_access::adopt(p, *p);
+    }
+  }
+
+  shared_ptr(const shared_ptr& r) noexcept : ptr_{r.ptr_}
+  {
+    if(ptr_) {
+      state(ptr_).add_shared();
+    }
+  }
+
+  template <class Y, typename = Convertible<Y*>>
+  shared_ptr(const shared_ptr<Y, intrusive<Counters>>& r) noexcept : ptr_{r.ptr_}
+  {
+    if(ptr_) {
+      state(ptr_).add_shared();
+    }
+  }
+
+  shared_ptr(shared_ptr&& r) noexcept : ptr_{r.ptr_} { r.ptr_ = nullptr; }
+
+  template <class Y, typename = Convertible<Y*>>
+  shared_ptr(shared_ptr<Y, intrusive<Counters>>&& r) noexcept : ptr_{r.ptr_}
+  {
+    r.ptr_ = nullptr;
+  }
+
+  template <class Y>
+  explicit shared_ptr(const weak_ptr<Y, intrusive<Counters>>& r) : ptr_{r.ptr_}
+  {
+    static_assert(std::is_convertible<Y*, T*>::value, "Y shall be convertible to T*");
+    if(!ptr_ || !state(ptr_).try_add_shared()) {
+      throw std::bad_weak_ptr{};
+    }
+  }
+
+  template <class Y, typename = Convertible<Y*>>
+  shared_ptr(std::unique_ptr<Y>&& r) noexcept : shared_ptr{r.release()}
+  {
+  }
+
+  ~shared_ptr()
+  {
+    if(ptr_) {
+      state(ptr_).release();
+    }
+  }
+
+  shared_ptr& operator=(const shared_ptr& r) noexcept
+  {
+    shared_ptr{r}.swap(*this);
+    return *this;
+  }
+  template <class Y>
+  shared_ptr& operator=(const shared_ptr<Y, intrusive<Counters>>& r) noexcept
+  {
+    shared_ptr{r}.swap(*this);
+    return *this;
+  }
+  shared_ptr& operator=(shared_ptr&& r) noexcept
+  {
+    shared_ptr{std::move(r)}.swap(*this);
+    return *this;
+  }
+  template <class Y>
+  shared_ptr& operator=(shared_ptr<Y, intrusive<Counters>>&& r) noexcept
+  {
+    shared_ptr{std::move(r)}.swap(*this);
+    return *this;
+  }
+
+  void swap(shared_ptr& r) noexcept { std::swap(ptr_, r.ptr_); }
+  void reset() noexcept { shared_ptr{}.swap(*this); }
+  template <class Y>
+  void reset(Y* p) noexcept
+  {
+    shared_ptr{p}.swap(*this);
+  }
+
+  T* get() const noexcept { return ptr_; }
+  T& operator*() const noexcept { return *ptr_; }
+  T* operator->() const noexcept { return ptr_; }
+  long use_count() const noexcept { return ptr_ ? state(ptr_).use_count() : 0; }
+  bool unique() const noexcept { return use_count() == 1; }
+  explicit operator bool() const noexcept { return ptr_ != nullptr; }
+  template<class U> bool owner_before(const shared_ptr<U, intrusive<Counters>>& b) const noexcept
+  {
+    return std::less<const void*>{}(owner(), b.owner());
+  }
+  template<class U> bool owner_before(const weak_ptr<U, intrusive<Counters>>& b) const noexcept
+  {
+    return std::less<const void*>{}(owner(), b.owner());
+  }
+  std::size_t owner_hash() const noexcept { return detail::hash_pointer(owner()); }
+  template<class U> bool owner_equal(const shared_ptr<U, intrusive<Counters>>& b) const noexcept { return owner() == b.owner(); }
+  template<class U> bool owner_equal(const weak_ptr<U, intrusive<Counters>>& b) const noexcept { return owner() == b.owner(); }
+
+private:
+  // the control block embedded in the object identifies the owner no matter which base is pointed to
+  const void* owner() const noexcept { return ptr_ ? &state(ptr_) : nullptr; }
+};
+
+// 20.11.2.2.6, shared_ptr creation
+namespace detail {
+
+// Control block and a pointer to the object constructed inside of it
+template<typename Counters, typename T>
+struct created_state {
+  state_base<Counters>* base;
+  T* ptr;
+};
+
+// The object is constructed inside of the control block so only one allocation is needed.
+template<typename T, typename Counters, typename A, typename... Args>
+created_state<Counters, T> create_object_state(const void*, const A& a, Args&&... args)
+{
+  using value_type = std::remove_cv_t<T>;
+  using allocator_type = typename std::allocator_traits<A>::template rebind_alloc<value_type>;
+  using state_type = inline_state<Counters, value_type, allocator_type>;
+
+  allocator_type alloc{a};
+  state_type* state = allocate_state<state_type>(alloc, alloc, std::forward<Args>(args)...);
+  return {state, state->ptr()};
+}
+
+// Objects deriving from embedded_shared_from_this bring their own control block so only the object is allocated
+template<typename T, typename Counters, typename U, typename A, typename... Args>
+created_state<Counters, T> create_object_state(const embedded_shared_from_this<U, Counters>*, const A&,
+                                               Args&&... args)
+{
+  using value_type = std::remove_cv_t<T>;
+  using byte_allocator = typename std::allocator_traits<A>::template rebind_alloc<char>;
+  static_assert(std::is_same<byte_allocator, std::allocator<char>>::value,
+                "objects with embedded counters are always freed with delete");
+
+  value_type* p = new value_type(std::forward<Args>(args)...);
+  return {embedded_ops<Counters, U, value_type>::adopt(p), p};
+}
+
+template<typename T, typename Counters, typename A, typename... Args>
+created_state<Counters, T> create_state(std::false_type, const A& a, Args&&... args)
+{
+  return create_object_state<T, Counters>(static_cast<T*>(nullptr), a, std::forward<Args>(args)...);
+}
+
+// Arrays are flattened to their innermost elements which follow the control block in the same allocation.
+// An initial value of a multidimensional element is repeated for every element.
+template<typename T, typename Counters, typename A, typename... Init>
+created_state<Counters, std::remove_extent_t<T>> create_array_state(const A& a, std::size_t size, const Init*... init)
+{
+  using element_type = std::remove_extent_t<T>;
+  using value_type = std::remove_cv_t<std::remove_all_extents_t<T>>;
+  using allocator_type = typename std::allocator_traits<A>::template rebind_alloc<value_type>;
+  using state_type = array_state<Counters, value_type, allocator_type>;
+  constexpr std::size_t inner_size = sizeof(element_type) / sizeof(value_type);
+
+  state_type* state = state_type::create(allocator_type{a}, size * inner_size, inner_size,
+                                         reinterpret_cast<const value_type*>(init)...);
+  return {state, reinterpret_cast<element_type*>(state->data())};
+}
+
+// T[N] is created without the number of elements and T[] with it
+template<typename T, typename Counters, bool Bounded>
+using array_created_state =
+    std::enable_if_t<(std::extent<T>::value != 0) == Bounded, created_state<Counters, std::remove_extent_t<T>>>;
+
+template<typename T, typename Counters, typename A>
+array_created_state<T, Counters, true> create_state(std::true_type, const A& a)
+{
+  return create_array_state<T, Counters>(a, std::extent<T>::value);
+}
+
+template<typename T, typename Counters, typename A>
+array_created_state<T, Counters, true> create_state(std::true_type, const A& a, const std::remove_extent_t<T>& init)
+{
+  return create_array_state<T, Counters>(a, std::extent<T>::value, std::addressof(init));
+}
+
+template<typename T, typename Counters, typename A>
+array_created_state<T, Counters, false> create_state(std::true_type, const A& a, std::size_t size)
+{
+  return create_array_state<T, Counters>(a, size);
+}
+
+template<typename T, typename Counters, typename A>
+array_created_state<T, Counters, false> create_state(std::true_type, const A& a, std::size_t size,
+                                                     const std::remove_extent_t<T>& init)
+{
+  return create_array_state<T, Counters>(a, size, std::addressof(init));
+}
+
+template<typename T, typename Counters>
+struct shared_factory {
+  template<typename A, typename... Args>
+  static shared_ptr<T, Counters> create(const A& a, Args&&... args)
+  {
+    auto created = create_state<T, Counters>(std::is_array<T>{}, a, std::forward<Args>(args)...);
+    shared_ptr<T, Counters> result{shared_state<Counters>{adopt_state, created.base}, created.ptr};
+    result.enable_weak_this(created.ptr);
+    return result;
+  }
+};
+
+// Intrusive pointers need no control block so only the object is allocated
+template<typename T, typename Counters>
+struct shared_factory<T, intrusive<Counters>> {
+  template<typename A, typename... Args>
+  static shared_ptr<T, intrusive<Counters>> create(const A&, Args&&... args)
+  {
+    using byte_allocator = typename std::allocator_traits<A>::template rebind_alloc<char>;
+    static_assert(std::is_same<byte_allocator, std::allocator<char>>::value,
+                  "objects with embedded counters are always freed with delete");
+    return shared_ptr<T, intrusive<Counters>>{new std::remove_cv_t<T>(std::forward<Args>(args)...)};
+  }
+};
+
+template<typename T, typename Counters, typename A, typename... Args>
+shared_ptr<T, Counters> allocate_shared(const A& a, Args&&... args)
+{
+  return shared_factory<T, Counters>::create(a, std::forward<Args>(args)...);
+}
+
+}
+
+template <class T, class A, class... Args>
+shared_ptr<T> allocate_shared(const A& a, Args&&... args)
+{
+  return detail::allocate_shared<T, atomic_counters>(a, std::forward<Args>(args)...);
+}
+
+template <class T, class... Args>
+shared_ptr<T> make_shared(Args&&... args)
+{
+  return experimental::allocate_shared<T>(std::allocator<std::remove_cv_t<T>>{}, std::forward<Args>(args)...);
+}
+
+// shared_ptr creation with a specific reference counting policy
+template <class T, class Counters, class A, class... Args>
+shared_ptr<T, Counters> allocate_shared_with(const A& a, Args&&... args)
+{
+  return detail::allocate_shared<T, Counters>(a, std::forward<Args>(args)...);
+}
+
+template <class T, class Counters, class... Args>
+shared_ptr<T, Counters> make_shared_with(Args&&... args)
+{
+  return experimental::allocate_shared_with<T, Counters>(std::allocator<std::remove_cv_t<T>>{},
+                                                          std::forward<Args>(args)...);
+}
+
+// intrusive_ptr creation with the counters of the intrusive_ref_base of T
+template <class T, class... Args>
+intrusive_ptr<T, typename T::intrusive_counters_type> make_intrusive(Args&&... args)
+{
+  return experimental::make_shared_with<T, intrusive<typename T::intrusive_counters_type>>(
+      std::forward<Args>(args)...);
+}
+
+// shared_ptr and weak_ptr with non-atomic counters. They must not be shared between threads.
+template <class T>
+using local_shared_ptr = shared_ptr<T, local_counters>;
+template <class T>
+using local_weak_ptr = weak_ptr<T, local_counters>;
+
+template <class T, class A, class... Args>
+local_shared_ptr<T> allocate_local_shared(const A& a, Args&&... args)
+{
+  return detail::allocate_shared<T, local_counters>(a, std::forward<Args>(args)...);
+}
+
+template <class T, class... Args>
+local_shared_ptr<T> make_local_shared(Args&&... args)
+{
+  return experimental::allocate_local_shared<T>(std::allocator<std::remove_cv_t<T>>{}, std::forward<Args>(args)...);
+}
+
+namespace detail {
+
+// Distance between the control block created by make_shared and the object stored inside of it
+// (see inline_state; an allocator without state takes no space)
+template<typename Counters, typename T>
+constexpr std::size_t inline_object_offset() noexcept
+{
+  return (sizeof(state_base<Counters>) + alignof(T) - 1) / alignof(T) * alignof(T);
+}
+
+template<typename T, typename Counters>
+T* inline_object(state_base<Counters>* base) noexcept
+{
+  return base ? reinterpret_cast<T*>(reinterpret_cast<char*>(base) + inline_object_offset<Counters, T>()) : nullptr;
+}
+
+}
+
+// One word shared_ptr to an object created by make_shared
+//
+// Only the control block pointer is stored as the object lives at a fixed offset inside of it. Converting
+// from a shared_ptr that does not point to such an object (an aliasing one or one adopting a pointer)
+// yields an empty thin_shared_ptr. Conversion back to shared_ptr always succeeds.
+template <typename T, typename Counters>
+class thin_shared_ptr {
+  static_assert(!std::is_array<T>::value, "arrays are not supported");
+
+  detail::state_base<Counters>* base_ = nullptr;
+
+  template<typename U, typename C> friend class thin_weak_ptr;
+
+  explicit thin_shared_ptr(detail::state_base<Counters>* base) noexcept : base_{base} {}
+
+  // returns the control block if the object of r is stored inside of it
+  static detail::state_base<Counters>* inline_base(const shared_ptr<T, Counters>& r) noexcept
+  {
+    detail::state_base<Counters>* base = r.state_.get();
+    return base && detail::inline_object<T>(base) == r.get() ? base : nullptr;
+  }
+
+public:
+  using element_type = T;
+  using weak_type = thin_weak_ptr<T, Counters>;
+
+  constexpr thin_shared_ptr() noexcept = default;
+  constexpr thin_shared_ptr(std::nullptr_t) noexcept {}
+
+  explicit thin_shared_ptr(const shared_ptr<T, Counters>& r) noexcept : base_{inline_base(r)}
+  {
+    if(base_) {
+      base_->add_shared();
+    }
+  }
+  explicit thin_shared_ptr(shared_ptr<T, Counters>&& r) noexcept : base_{inline_base(r)}
+  {
+    if(base_) {
+      r.state_.release();
+      r.ptr_ = nullptr;
+    }
+  }
+
+  thin_shared_ptr(const thin_shared_ptr& r) noexcept : base_{r.base_}
+  {
+    if(base_) {
+      base_->add_shared();
+    }
+  }
+  thin_shared_ptr(thin_shared_ptr&& r) noexcept : base_{r.base_} { r.base_ = nullptr; }
+
+  ~thin_shared_ptr()
+  {
+    if(base_) {
+      base_->release();
+    }
+  }
+
+  thin_shared_ptr& operator=(const thin_shared_ptr& r) noexcept
+  {
+    thin_shared_ptr{r}.swap(*this);
     return *this;
   }
-  template<class Y> weak_ptr& operator=(weak_ptr<Y>&& r) noexcept
+  thin_shared_ptr& operator=(thin_shared_ptr&& r) noexcept
   {
-    ptr_ = r.lock().get();
-    state_ = std::move(r.state_);
-    r.ptr_ = nullptr;
+    thin_shared_ptr{std::move(r)}.swap(*this);
     return *this;
   }
 
-  // 20.11.2.3.4, modifiers
-  void swap(weak_ptr& r) noexcept;
-  void reset() noexcept;
-// 20.11.2.3.5, observers
-  long use_count() const noexcept { return state_.use_count(); }
-  bool expired() const noexcept { return state_.expired(); }
-  shared_ptr<T> lock() const noexcept { return shared_ptr<T>(*this, std::nothrow); }
-  template<class U> bool owner_before(shared_ptr<U> const& b) const;
-  template<class U> bool owner_before(weak_ptr<U> const& b) const;
+  operator shared_ptr<T, Counters>() const& noexcept
+  {
+    if(base_) {
+      base_->add_shared();
+    }
+    return shared_ptr<T, Counters>{detail::shared_state<Counters>{detail::adopt_state, base_}, get()};
+  }
+  operator shared_ptr<T, Counters>() && noexcept
+  {
+    T* p = get();
+    detail::shared_state<Counters> state{detail::adopt_state, std::exchange(base_, nullptr)};
+    return shared_ptr<T, Counters>{std::move(state), p};
+  }
+
+  void swap(thin_shared_ptr& r) noexcept { std::swap(base_, r.base_); }
+  void reset() noexcept { thin_shared_ptr{}.swap(*this); }
+
+  T* get() const noexcept { return detail::inline_object<T>(base_); }
+  T& operator*() const noexcept { return *get(); }
+  T* operator->() const noexcept { return get(); }
+  long use_count() const noexcept { return base_ ? base_->use_count() : 0; }
+  explicit operator bool() const noexcept { return base_ != nullptr; }
 };
 
-// 20.11.2.3.6, specialized algorithms
-template<class T> void swap(weak_ptr<T>& a, weak_ptr<T>& b) noexcept;
+template <class T, class Counters = atomic_counters, class... Args>
+thin_shared_ptr<T, Counters> make_thin_shared(Args&&... args)
+{
+  return thin_shared_ptr<T, Counters>{make_shared_with<T, Counters>(std::forward<Args>(args)...)};
+}
 
+// One word weak_ptr observing an object created by make_shared
+template <typename T, typename Counters>
+class thin_weak_ptr {
+  detail::state_base<Counters>* base_ = nullptr;
 
-template <class T>
-class shared_ptr {
-  template<typename U>
-  using Convertible = std::enable_if_t<std::is_convertible<U, T*>::value>;
+public:
+  using element_type = T;
 
-  T* ptr_ = nullptr;
-  detail::shared_state state_;
+  constexpr thin_weak_ptr() noexcept = default;
+
+  thin_weak_ptr(const thin_shared_ptr<T, Counters>& r) noexcept : base_{r.base_}
+  {
+    if(base_) {
+      base_->add_weak();
+    }
+  }
+  thin_weak_ptr(const thin_weak_ptr& r) noexcept : base_{r.base_}
+  {
+    if(base_) {
+      base_->add_weak();
+    }
+  }
+  thin_weak_ptr(thin_weak_ptr&& r) noexcept : base_{r.base_} { r.base_ = nullptr; }
 
-  template<typename U> friend class shared_ptr;
-  template<typename U> friend class weak_ptr;
+  ~thin_weak_ptr()
+  {
+    if(base_) {
+      base_->weak_release();
+    }
+  }
 
-  template <class Y>
-  explicit shared_ptr(const weak_ptr<Y>& r, std::nothrow_t) : ptr_{r.ptr_}, state_{r.state_, std::nothrow}
+  thin_weak_ptr& operator=(const thin_weak_ptr& r) noexcept
   {
-    static_assert(std::is_convertible<Y*, T*>::value, "Y shall be convertible to T*");
+    thin_weak_ptr{r}.swap(*this);
+    return *this;
+  }
+  thin_weak_ptr& operator=(thin_weak_ptr&& r) noexcept
+  {
+    thin_weak_ptr{std::move(r)}.swap(*this);
+    return *this;
+  }
+
+  operator weak_ptr<T, Counters>() const noexcept
+  {
+    weak_ptr<T, Counters> result;
+    if(base_) {
+      base_->add_weak();
+      result.ptr_ = detail::inline_object<T>(base_);
+      result.state_ = detail::weak_state<Counters>{detail::adopt_state, base_};
+    }
+    return result;
+  }
+
+  void swap(thin_weak_ptr& r) noexcept { std::swap(base_, r.base_); }
+  void reset() noexcept { thin_weak_ptr{}.swap(*this); }
+
+  long use_count() const noexcept { return base_ ? base_->use_count() : 0; }
+  bool expired() const noexcept { return use_count() == 0; }
+  thin_shared_ptr<T, Counters> lock() const noexcept
+  {
+    if(base_ && base_->try_add_shared()) {
+      return thin_shared_ptr<T, Counters>{base_};
+    }
+    return {};
   }
+};
+
+// Unique owner of an object created together with the control block of its future shared owners
+//
+// The object is created like with make_shared but the control block stays private to this pointer
+// until it is converted to a shared_ptr. The conversion does not allocate nor touch the counters and
+// destroying an object that was never shared does not update them either. Objects deriving from
+// embedded_shared_from_this may hand out references on their own, so they are always released through
+// the counters.
+template <typename T, typename Counters>
+class unique_shareable_ptr {
+  static_assert(!std::is_array<T>::value, "arrays are not supported");
+  static_assert(!detail::is_intrusive<Counters>::value,
+                "objects with intrusive counters are created by make_intrusive");
+  static constexpr bool embedded = detail::has_embedded_state<T, Counters>::value;
+
+  T* ptr_ = nullptr;
+  detail::state_base<Counters>* base_ = nullptr;
+
+  template<typename U, typename C> friend class unique_shareable_ptr;
+  template<typename U, typename C, typename... Args>
+  friend unique_shareable_ptr<U, C> make_unique_shareable(Args&&... args);
+
+  unique_shareable_ptr(T* p, detail::state_base<Counters>* base) noexcept : ptr_{p}, base_{base} {}
 
 public:
-  using element_type = std::remove_extent_t<T>;
-  using weak_type = weak_ptr<T>;
+  using element_type = T;
 
-  // 20.11.2.2.1, constructors:
-  constexpr shared_ptr() noexcept = default;
+  constexpr unique_shareable_ptr() noexcept = default;
+  constexpr unique_shareable_ptr(std::nullptr_t) noexcept {}
 
-  template <class Y>
-  explicit shared_ptr(Y* p) : ptr_{p}, state_{p}
+  unique_shareable_ptr(unique_shareable_ptr&& r) noexcept : ptr_{r.ptr_}, base_{r.base_}
   {
-    static_assert(std::is_convertible<decltype(p), T*>::value, "p shall be convertible to T*");
-    static_assert(!std::is_void<Y>::value, "Y shall be a complete type" );
-    static_assert(sizeof(Y) > 0, "Y shall be a complete type" );
-    static_assert(std::is_nothrow_destructible<decltype(p)>::value,
-                  "The expression delete p shall not throw exceptions");
+    r.ptr_ = nullptr;
+    r.base_ = nullptr;
+  }
+  template <class Y, typename = std::enable_if_t<std::is_convertible<Y*, T*>::value>>
+  unique_shareable_ptr(unique_shareable_ptr<Y, Counters>&& r) noexcept : ptr_{r.ptr_}, base_{r.base_}
+  {
+    static_assert(embedded || !unique_shareable_ptr<Y, Counters>::embedded,
+                  "objects with embedded counters have to be released through them");
+    r.ptr_ = nullptr;
+    r.base_ = nullptr;
+  }
 
-    // if (p != nullptr && p->weak_this.expired())
-    //    p->weak_this = shared_ptr<remove_cv_t<Y>>(*this,
-    //    const_cast<remove_cv_t<Y>*>(p));
+  ~unique_shareable_ptr()
+  {
+    if(base_) {
+      if(embedded) {
+        base_->release();
+      }
+      else {
+        base_->release_unique();
+      }
+    }
   }
 
-  template <class Y, class D>
-  shared_ptr(Y* p, D d) : ptr_{p}, state_{p, std::move(d)}
+  unique_shareable_ptr& operator=(unique_shareable_ptr&& r) noexcept
   {
-    static_assert(std::is_convertible<decltype(p), T*>::value, "p shall be convertible to T*");
-    static_assert(std::is_copy_constructible<D>::value,
-                  "D shall be CopyConstructible and such construction shall not throw exceptions");
-//  static_assert(std::is_nothrow_copy_constructible(D),
-//                "D shall be CopyConstructible and such construction shall not throw exceptions");
-    static_assert(std::is_nothrow_destructible<D>::value, "The destructor of D shall not throw exceptions");
+    unique_shareable_ptr{std::move(r)}.swap(*this);
+    return *this;
+  }
 
-    // if (p != nullptr && p->weak_this.expired())
-    //    p->weak_this = shared_ptr<remove_cv_t<Y>>(*this,
-    //    const_cast<remove_cv_t<Y>*>(p));
+  operator shared_ptr<T, Counters>() && noexcept
+  {
+    T* p = std::exchange(ptr_, nullptr);
+    shared_ptr<T, Counters> result{detail::shared_state<Counters>{detail::adopt_state, std::exchange(base_, nullptr)},
+                                   p};
+    result.enable_weak_this(p);
+    return result;
   }
+  shared_ptr<T, Counters> share() && noexcept { return std::move(*this); }
 
-  template <class Y, class D, class A>
-  shared_ptr(Y* p, D d, A a) : ptr_{p}, state_{p, std::move(d), std::move(a)}
+  void swap(unique_shareable_ptr& r) noexcept
   {
-    static_assert(std::is_convertible<decltype(p), T*>::value, "p shall be convertible to T*");
-    static_assert(std::is_copy_constructible<D>::value,
-                  "D shall be CopyConstructible "
-                  "and such construction shall "
-                  "not throw exceptions");
-    // static_assert(std::is_nothrow_copy_constructible(D), "D shall be
-    // CopyConstructible and such construction shall not throw exceptions");
-    static_assert(std::is_nothrow_destructible<D>::value, "The destructor of D shall not throw exceptions");
-    static_assert(std::is_copy_constructible<A>::value,
-                  "A shall be CopyConstructible "
-                  "and such construction shall "
-                  "not throw exceptions");
-    //            static_assert(std::is_nothrow_copy_constructible(A), "A shall
-    //            be CopyConstructible and such construction shall not throw
-    //            exceptions");
-    static_assert(std::is_nothrow_destructible<A>::value, "The destructor of A shall not throw exceptions");
+    std::swap(ptr_, r.ptr_);
+    std::swap(base_, r.base_);
+  }
+  void reset() noexcept { unique_shareable_ptr{}.swap(*this); }
 
-    // if (p != nullptr && p->weak_this.expired())
-    //    p->weak_this = shared_ptr<remove_cv_t<Y>>(*this,
-    //    const_cast<remove_cv_t<Y>*>(p));
+  T* get() const noexcept { return ptr_; }
+  T& operator*() const noexcept { return *ptr_; }
+  T* operator->() const noexcept { return ptr_; }
+  explicit operator bool() const noexcept { return ptr_ != nullptr; }
+};
+
+template <class T, class Counters = atomic_counters, class... Args>
+unique_shareable_ptr<T, Counters> make_unique_shareable(Args&&... args)
+{
+  auto created = detail::create_state<T, Counters>(std::false_type{}, std::allocator<std::remove_cv_t<T>>{},
+                                                    std::forward<Args>(args)...);
+  return unique_shareable_ptr<T, Counters>{created.ptr, created.base};
+}
+
+// Borrowed pointers are checked in debug builds
+#if !defined(NDEBUG) && !defined(SHARED_PTR_2_CHECKED_BORROWS)
+#define SHARED_PTR_2_CHECKED_BORROWS
+#endif
+
+// Non-owning pointer to an object owned by shared_ptr for passing it down the call stack
+//
+// Borrowing from a shared_ptr and copying do not touch the counters so an owner has to outlive the
+// borrowed pointer. A callee that decides to keep the object calls retain() which takes a reference
+// with a single increment. With SHARED_PTR_2_CHECKED_BORROWS (defined by default in debug builds) a
+// borrowed pointer holds a weak reference instead and terminates the program if it is used after the
+// last owner is gone. Objects owned by intrusive pointers are borrowed as plain references as
+// shared_from_this() retains them.
+template <typename T, typename Counters>
+class borrowed_ptr {
+  static_assert(!detail::is_intrusive<Counters>::value, "objects with intrusive counters are borrowed as references");
+
+  template<typename U>
+  using Convertible = std::enable_if_t<std::is_convertible<U, T*>::value>;
+
+  T* ptr_ = nullptr;
+  detail::state_base<Counters>* base_ = nullptr;
+
+  template<typename U, typename C> friend class borrowed_ptr;
+
+  void acquire() const noexcept
+  {
+#ifdef SHARED_PTR_2_CHECKED_BORROWS
+    if(base_) {
+      base_->add_weak();
+    }
+#endif
   }
-
-  template <class D>
-  shared_ptr(std::nullptr_t p, D d) : ptr_{p}, state_{p, std::move(d)}
+  void check() const noexcept
   {
-    static_assert(std::is_copy_constructible<D>::value,
-                  "D shall be CopyConstructible "
-                  "and such construction shall "
-                  "not throw exceptions");
-    // static_assert(std::is_nothrow_copy_constructible(D), "D shall be
-    // CopyConstructible and such construction shall not throw exceptions");
-    static_assert(std::is_nothrow_destructible<D>::value, "The destructor of D shall not throw exceptions");
-
+#ifdef SHARED_PTR_2_CHECKED_BORROWS
+    if(base_ && base_->use_count() == 0) {
+      std::terminate();  // the object was destroyed while still borrowed
+    }
+#endif
   }
 
-  template <class D, class A>
-  shared_ptr(std::nullptr_t p, D d, A a) : ptr_{p}, state_{p, std::move(d), std::move(a)}
+public:
+  using element_type = T;
+
+  constexpr borrowed_ptr() noexcept = default;
+  constexpr borrowed_ptr(std::nullptr_t) noexcept {}
+
+  template <class Y, typename = Convertible<Y*>>
+  borrowed_ptr(const shared_ptr<Y, Counters>& r) noexcept : ptr_{r.ptr_}, base_{r.state_.get()}
   {
-    static_assert(std::is_copy_constructible<D>::value,
-                  "D shall be CopyConstructible "
-                  "and such construction shall "
-                  "not throw exceptions");
-    // static_assert(std::is_nothrow_copy_constructible(D), "D shall be
-    // CopyConstructible and such construction shall not throw exceptions");
-    static_assert(std::is_nothrow_destructible<D>::value, "The destructor of D shall not throw exceptions");
-    static_assert(std::is_copy_constructible<A>::value,
-                  "A shall be CopyConstructible "
-                  "and such construction shall "
-                  "not throw exceptions");
-    //            static_assert(std::is_nothrow_copy_constructible(A), "A shall
-    //            be CopyConstructible and such construction shall not throw
-    //            exceptions");
-    static_assert(std::is_nothrow_destructible<A>::value, "The destructor of A shall not throw exceptions");
+    acquire();
   }
-
+  // a temporary owner would be gone before the borrowed pointer is used
   template <class Y>
-  shared_ptr(const shared_ptr<Y>& r, T* p) noexcept : ptr_{p}, state_{r.state_}
+  borrowed_ptr(const shared_ptr<Y, Counters>&&) = delete;
+
+  borrowed_ptr(const borrowed_ptr& r) noexcept : ptr_{r.ptr_}, base_{r.base_} { acquire(); }
+  template <class Y, typename = Convertible<Y*>>
+  borrowed_ptr(const borrowed_ptr<Y, Counters>& r) noexcept : ptr_{r.ptr_}, base_{r.base_}
   {
+    acquire();
   }
 
-  shared_ptr(const shared_ptr& r) noexcept = default;
+  ~borrowed_ptr()
+  {
+#ifdef SHARED_PTR_2_CHECKED_BORROWS
+    if(base_) {
+      base_->weak_release();
+    }
+#endif
+  }
 
-  template <class Y, typename = Convertible<Y*>>
-  shared_ptr(const shared_ptr<Y>& r) noexcept : ptr_{r.ptr_}, state_{r.state_}
+  borrowed_ptr& operator=(const borrowed_ptr& r) noexcept
   {
+    borrowed_ptr{r}.swap(*this);
+    return *this;
   }
 
-  shared_ptr(shared_ptr&& r) noexcept : ptr_{std::move(r.ptr_)}, state_{std::move(r.state_)}
+  void swap(borrowed_ptr& r) noexcept
   {
-    r.ptr_ = nullptr;
+    std::swap(ptr_, r.ptr_);
+    std::swap(base_, r.base_);
   }
 
-  template <class Y, typename = Convertible<Y*>>
-  shared_ptr(shared_ptr<Y>&& r) noexcept : ptr_{std::move(r.ptr_)}, state_{std::move(r.state_)}
+  // shares the ownership of the borrowed object
+  shared_ptr<T, Counters> retain() const noexcept
   {
-    r.ptr_ = nullptr;
+    check();
+    if(base_) {
+      base_->add_shared();
+    }
+    return shared_ptr<T, Counters>{detail::shared_state<Counters>{detail::adopt_state, base_}, ptr_};
   }
 
-  template <class Y>
-  explicit shared_ptr(const weak_ptr<Y>& r) : ptr_{r.ptr_}, state_{r.state_}
+  T* get() const noexcept
   {
-    static_assert(std::is_convertible<Y*, T*>::value, "Y shall be convertible to T*");
+    check();
+    return ptr_;
   }
+  T& operator*() const noexcept { return *get(); }
+  T* operator->() const noexcept { return get(); }
+  explicit operator bool() const noexcept { return ptr_ != nullptr; }
+};
 
-  template <class Y, class D, typename = Convertible<typename std::unique_ptr<Y, D>::pointer>>
-  shared_ptr(std::unique_ptr<Y, D>&& r)
+// Types whose objects may be moved to another address with memcpy after which the source is treated as
+// destroyed (trivially relocatable as proposed in P1144). Containers like relocating_vector use it to grow
+// and erase without running move constructors and destructors.
+template <class T>
+struct is_trivially_relocatable : std::is_trivially_copyable<T> {};
+
+// Smart pointers only hold addresses of objects and control blocks and nothing points back to them
+template <class T, class Counters>
+struct is_trivially_relocatable<shared_ptr<T, Counters>> : std::true_type {};
+template <class T, class Counters>
+struct is_trivially_relocatable<weak_ptr<T, Counters>> : std::true_type {};
+template <class T, class Counters>
+struct is_trivially_relocatable<thin_shared_ptr<T, Counters>> : std::true_type {};
+template <class T, class Counters>
+struct is_trivially_relocatable<thin_weak_ptr<T, Counters>> : std::true_type {};
+template <class T, class Counters>
+struct is_trivially_relocatable<unique_shareable_ptr<T, Counters>> : std::true_type {};
+template <class T, class Counters>
+struct is_trivially_relocatable<borrowed_ptr<T, Counters>> : std::true_type {};
+
+namespace detail {
+
+// Gives the batched reference counting functions access to the internals of shared_ptr
+struct batch_access {
+  static constexpr std::size_t max_batch = static_cast<std::size_t>(std::numeric_limits<int>::max());
+
+  template<typename T, typename Counters, typename OutputIt>
+  static OutputIt share_n(const shared_ptr<T, Counters>& r, std::size_t n, OutputIt out)
   {
-    if(r.get()) {
-      // auto p = r.release;
-      // if (p != nullptr && p->weak_this.expired())
-      //    p->weak_this = shared_ptr<remove_cv_t<Y>>(*this,
-      //    const_cast<remove_cv_t<Y>*>(p));
+    state_base<Counters>* base = r.state_.get();
+    while(n > 0) {
+      const int batch = n < max_batch ? static_cast<int>(n) : std::numeric_limits<int>::max();
+      if(base) {
+        base->add_shared(batch);
+      }
+      int left = batch;
+      try {
+        while(left > 0) {
+          shared_ptr<T, Counters> copy{shared_state<Counters>{adopt_state, base}, r.ptr_};
+          --left;
+          *out = std::move(copy);
+          ++out;
+        }
+      }
+      catch(...) {
+        if(base && left > 0) {
+          base->release(left);
+        }
+        throw;
+      }
+      n -= static_cast<std::size_t>(batch);
+    }
+    return out;
+  }
 
-      if(std::is_reference<D>::value) {
-        swap(shared_ptr{r.release(), std::ref(r.get_deleter())});
+  template<typename ForwardIt>
+  static void release_n(ForwardIt first, ForwardIt last) noexcept
+  {
+    while(first != last) {
+      auto* base = first->state_.get();
+      int count = 0;
+      for(; first != last && first->state_.get() == base && static_cast<std::size_t>(count) < max_batch; ++first) {
+        first->state_.release();
+        first->ptr_ = nullptr;
+        ++count;
       }
-      else {
-        swap(shared_ptr{r.release(), r.get_deleter()});
+      if(base) {
+        base->release(count);
       }
     }
   }
 
-  constexpr shared_ptr(std::nullptr_t) noexcept : shared_ptr() {}
+  // Small direct-mapped cache of the references released per control block
+  //
+  // A block is prefetched when it enters the cache and its references are released when it is evicted
+  // by another one or when the cache is destroyed, so the misses overlap with the counting of the
+  // following pointers.
+  template<typename BasePtr>
+  class release_cache {
+    static constexpr unsigned bits = 8;
+    struct entry {
+      BasePtr base;
+      std::size_t count;
+    };
+    entry entries_[std::size_t{1} << bits] = {};
+
+    static std::size_t index(BasePtr base) noexcept
+    {
+      // Fibonacci hashing keeps the well mixed high bits of the product
+      const auto key = static_cast<std::uint64_t>(reinterpret_cast<std::uintptr_t>(base));
+      return static_cast<std::size_t>((key * 0x9E3779B97F4A7C15ull) >> (64 - bits));
+    }
+    static void flush(entry& e) noexcept
+    {
+      for(; e.count > max_batch; e.count -= max_batch) {
+        e.base->release(std::numeric_limits<int>::max());
+      }
+      if(e.count) {
+        e.base->release(static_cast<int>(e.count));
+      }
+    }
 
-  // 20.11.2.2.2, destructor:
-  ~shared_ptr() = default;
+  public:
+    release_cache() = default;
+    release_cache(const release_cache&) = delete;
+    release_cache& operator=(const release_cache&) = delete;
+    ~release_cache()
+    {
+      for(entry& e : entries_) {
+        flush(e);
+      }
+    }
 
-  // 20.11.2.2.3, assignment:
-  shared_ptr& operator=(const shared_ptr& r) noexcept = default;
-  template <class Y>
-  shared_ptr& operator=(const shared_ptr<Y>& r) noexcept;
-  shared_ptr& operator=(shared_ptr&& r) noexcept = default;
-  template <class Y>
-  shared_ptr& operator=(shared_ptr<Y>&& r) noexcept;
-  template <class Y, class D>
-  shared_ptr& operator=(std::unique_ptr<Y, D>&& r);
-  // 20.11.2.2.4, modifiers:
-  void swap(shared_ptr& r) noexcept
+    void add(BasePtr base) noexcept
+    {
+      entry& e = entries_[index(base)];
+      if(e.base != base) {
+        flush(e);
+        prefetch_for_write(base);
+        e = entry{base, 0};
+      }
+      ++e.count;
+    }
+  };
+
+  template<typename ForwardIt>
+  static void release_all(ForwardIt first, ForwardIt last) noexcept
   {
-    using std::swap;
-    swap(state_, r.state_);
-    swap(ptr_, r.ptr_);
+    release_cache<decltype(first->state_.get())> cache;
+    for(; first != last; ++first) {
+      if(auto* base = first->state_.release()) {
+        cache.add(base);
+      }
+      first->ptr_ = nullptr;
+    }
   }
-  void reset() noexcept;
-  template <class Y>
-  void reset(Y* p);
-  template <class Y, class D>
-  void reset(Y* p, D d);
-  template <class Y, class D, class A>
-  void reset(Y* p, D d, A a);
-  // 20.11.2.2.5, observers:
-  T* get() const noexcept { return ptr_; }
-  T& operator*() const noexcept;
-  T* operator->() const noexcept;
-  long use_count() const noexcept { return state_.use_count(); }
-  bool unique() const noexcept { return use_count() == 1; }
-  explicit operator bool() const noexcept { return get() != nullptr; }
-  template <class U>
-  bool owner_before(shared_ptr<U> const& b) const;
-  template <class U>
-  bool owner_before(weak_ptr<U> const& b) const;
 };
 
-// 20.11.2.2.6, shared_ptr creation
-template <class T, class... Args>
-shared_ptr<T> make_shared(Args&&... args);
-template <class T, class A, class... Args>
-shared_ptr<T> allocate_shared(const A& a, Args&&... args);
+}  // namespace detail
+
+// Batched reference counting
+//
+// share_n() makes n copies of r with a single update of the counters. release_n() resets all pointers
+// in a range and releases every run of consecutive pointers sharing a control block with a single
+// update as well.
+template <class T, class Counters, class OutputIt>
+OutputIt share_n(const shared_ptr<T, Counters>& r, std::size_t n, OutputIt out)
+{
+  return detail::batch_access::share_n(r, n, out);
+}
+
+template <std::size_t N, class T, class Counters>
+std::array<shared_ptr<T, Counters>, N> share_n(const shared_ptr<T, Counters>& r)
+{
+  std::array<shared_ptr<T, Counters>, N> result;
+  detail::batch_access::share_n(r, N, result.begin());
+  return result;
+}
+
+template <class ForwardIt>
+void release_n(ForwardIt first, ForwardIt last) noexcept
+{
+  detail::batch_access::release_n(first, last);
+}
+
+// Resets all pointers in a range coalescing the releases of pointers sharing a control block even if
+// they are not next to each other. The references are counted in a small cache of recently seen blocks
+// and each block is prefetched when it enters the cache, long before its counters are updated. Ranges
+// with up to a few hundred distinct owners release every control block exactly once.
+template <class ForwardIt>
+void release_all(ForwardIt first, ForwardIt last) noexcept
+{
+  detail::batch_access::release_all(first, last);
+}
 
 // 20.11.2.2.7, shared_ptr comparisons:
-template <class T, class U>
-bool operator==(const shared_ptr<T>& a, const shared_ptr<U>& b) noexcept;
-template <class T, class U>
-bool operator!=(const shared_ptr<T>& a, const shared_ptr<U>& b) noexcept;
+template <class T, class U, class Counters>
+bool operator==(const shared_ptr<T, Counters>& a, const shared_ptr<U, Counters>& b) noexcept
+{
+  return a.get() == b.get();
+}
+template <class T, class U, class Counters>
+bool operator!=(const shared_ptr<T, Counters>& a, const shared_ptr<U, Counters>& b) noexcept
+{
+  return !(a == b);
+}
 template <class T, class U>
 bool operator<(const shared_ptr<T>& a, const shared_ptr<U>& b) noexcept;
 template <class T, class U>
@@ -630,46 +3090,370 @@ D* get_deleter(const shared_ptr<T>& p) noexcept;
 template <class E, class T, class Y>
 std::basic_ostream<E, T>& operator<<(std::basic_ostream<E, T>& os, const shared_ptr<Y>& p) { return os << p.get(); }
 
+namespace detail {
+
+// lets a sibling hyper-thread run while spinning
+inline void cpu_relax() noexcept
+{
+#if defined(__i386__) || defined(__x86_64__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  __asm__ __volatile__("yield");
+#endif
+}
+
+// Gives the atomic_* free functions access to the internals of shared_ptr. Operations on the same
+// shared_ptr object are serialized with one of a fixed set of spin locks picked by its address. Locks
+// are a cache line apart so unrelated shared_ptr objects contend only if their addresses map to the
+// same lock.
+struct atomic_access {
+  static constexpr std::size_t lock_count = 64;
+  static constexpr unsigned max_backoff = 64;
+
+  struct spin_lock {
+    std::atomic<bool> locked{false};
+    char padding[cache_line_size - sizeof(std::atomic<bool>)];
+  };
+
+  class guard {
+    std::atomic<bool>& locked_;
+
+  public:
+    explicit guard(const void* p) noexcept : locked_{lock_for(p).locked}
+    {
+      unsigned backoff = 1;
+      while(locked_.exchange(true, std::memory_order_acquire)) {
+        while(locked_.load(std::memory_order_relaxed)) {
+          // critical sections are a few instructions long so a holder that takes longer was preempted
+          if(backoff > max_backoff) {
+            std::this_thread::yield();
+            continue;
+          }
+          for(unsigned i = 0; i < backoff; ++i) {
+            cpu_relax();
+          }
+          backoff *= 2;
+        }
+      }
+    }
+    guard(const guard&) = delete;
+    guard& operator=(const guard&) = delete;
+    ~guard() { locked_.store(false, std::memory_order_release); }
+  };
+
+  static spin_lock& lock_for(const void* p) noexcept
+  {
+    static spin_lock locks[lock_count];
+    return locks[hash_pointer(p) % lock_count];
+  }
+
+  template<typename T>
+  static bool equivalent(const shared_ptr<T>& a, const shared_ptr<T>& b) noexcept
+  {
+    return a.ptr_ == b.ptr_ && a.state_.base_ == b.state_.base_;
+  }
+
+  template<typename T>
+  static shared_ptr<T> load(const shared_ptr<T>& p) noexcept
+  {
+    guard g{&p};
+    return p;
+  }
+
+  // swaps the contents of p and r
+  template<typename T>
+  static void exchange(shared_ptr<T>& p, shared_ptr<T>& r) noexcept
+  {
+    guard g{&p};
+    p.swap(r);
+  }
+
+  template<typename T>
+  static bool compare_exchange(shared_ptr<T>& p, shared_ptr<T>& v, shared_ptr<T>& desired) noexcept
+  {
+    shared_ptr<T> actual;
+    {
+      guard g{&p};
+      if(equivalent(p, v)) {
+        p.swap(desired);
+        return true;
+      }
+      actual = p;
+    }
+    // the old value of v is released outside of the lock
+    v = std::move(actual);
+    return false;
+  }
+};
+
+}
+
 // 20.11.2.6, shared_ptr atomic access:
+// Operations on a plain shared_ptr are serialized with address-keyed spin locks so they are not lock-free.
+// A shared_ptr is two words that are not atomic objects, so lock-free access would need a double-width
+// compare-and-swap on memory other code reads and writes non-atomically. Use atomic_shared_ptr, whose
+// readers never wait for each other, where lock-free access is needed.
 template <class T>
-bool atomic_is_lock_free(const shared_ptr<T>* p);
-template <class T>
-shared_ptr<T> atomic_load(const shared_ptr<T>* p);
+bool atomic_is_lock_free(const shared_ptr<T>*)
+{
+  return false;
+}
+
 template <class T>
-shared_ptr<T> atomic_load_explicit(const shared_ptr<T>* p, std::memory_order mo);
+shared_ptr<T> atomic_load_explicit(const shared_ptr<T>* p, std::memory_order)
+{
+  return detail::atomic_access::load(*p);
+}
+
 template <class T>
-void atomic_store(shared_ptr<T>* p, shared_ptr<T> r);
+shared_ptr<T> atomic_load(const shared_ptr<T>* p)
+{
+  return atomic_load_explicit(p, std::memory_order_seq_cst);
+}
+
 template <class T>
-void atomic_store_explicit(shared_ptr<T>* p, shared_ptr<T> r, std::memory_order mo);
+shared_ptr<T> atomic_exchange_explicit(shared_ptr<T>* p, shared_ptr<T> r, std::memory_order)
+{
+  detail::atomic_access::exchange(*p, r);
+  return r;
+}
+
 template <class T>
-shared_ptr<T> atomic_exchange(shared_ptr<T>* p, shared_ptr<T> r);
+shared_ptr<T> atomic_exchange(shared_ptr<T>* p, shared_ptr<T> r)
+{
+  return atomic_exchange_explicit(p, std::move(r), std::memory_order_seq_cst);
+}
+
 template <class T>
-shared_ptr<T> atomic_exchange_explicit(shared_ptr<T>* p, shared_ptr<T> r, std::memory_order mo);
+void atomic_store_explicit(shared_ptr<T>* p, shared_ptr<T> r, std::memory_order mo)
+{
+  atomic_exchange_explicit(p, std::move(r), mo);
+}
+
 template <class T>
-bool atomic_compare_exchange_weak(shared_ptr<T>* p, shared_ptr<T>* v, shared_ptr<T> w);
+void atomic_store(shared_ptr<T>* p, shared_ptr<T> r)
+{
+  atomic_store_explicit(p, std::move(r), std::memory_order_seq_cst);
+}
+
 template <class T>
-bool atomic_compare_exchange_strong(shared_ptr<T>* p, shared_ptr<T>* v, shared_ptr<T> w);
+bool atomic_compare_exchange_strong_explicit(shared_ptr<T>* p, shared_ptr<T>* v, shared_ptr<T> w, std::memory_order,
+                                             std::memory_order)
+{
+  return detail::atomic_access::compare_exchange(*p, *v, w);
+}
+
 template <class T>
 bool atomic_compare_exchange_weak_explicit(shared_ptr<T>* p, shared_ptr<T>* v, shared_ptr<T> w, std::memory_order success,
-                                           std::memory_order failure);
+                                           std::memory_order failure)
+{
+  return atomic_compare_exchange_strong_explicit(p, v, std::move(w), success, failure);
+}
+
+template <class T>
+bool atomic_compare_exchange_strong(shared_ptr<T>* p, shared_ptr<T>* v, shared_ptr<T> w)
+{
+  return atomic_compare_exchange_strong_explicit(p, v, std::move(w), std::memory_order_seq_cst,
+                                                 std::memory_order_seq_cst);
+}
+
+template <class T>
+bool atomic_compare_exchange_weak(shared_ptr<T>* p, shared_ptr<T>* v, shared_ptr<T> w)
+{
+  return atomic_compare_exchange_strong(p, v, std::move(w));
+}
+
+// Lock-free atomic shared_ptr based on split reference counting.
+//
+// Every stored value is kept in its own immutable node (a control block with the shared_ptr<T> embedded
+// in it). The atomic word packs the node pointer together with a "local" count of readers that are
+// currently copying from that node. A reader bumps the local count with a single fetch_add, copies the
+// value and hands its local reference back. A writer that replaces the node transfers the outstanding
+// local count into the node's shared counter so that late readers release the node through it.
+//
+// Readers that lost the race may release the node before the writer managed to transfer the local count.
+// That is why the shared counter of a published node starts at 0 and is allowed to become negative. It is
+// the transfer (done together with the release of the reference held by the atomic) that brings it back.
 template <class T>
-bool atomic_compare_exchange_strong_explicit(shared_ptr<T>* p, shared_ptr<T>* v, shared_ptr<T> w, std::memory_order success,
-                                             std::memory_order failure);
+class atomic_shared_ptr {
+  using node_type = detail::inline_state<atomic_counters, shared_ptr<T>>;
+  using word_type = std::uint64_t;
+
+  static constexpr int local_shift = sizeof(void*) == 8 ? 48 : 32;
+  static constexpr word_type local_one = word_type{1} << local_shift;
+  static constexpr word_type ptr_mask = local_one - 1;
+
+  mutable std::atomic<word_type> word_{0};
+
+  static node_type* node(word_type w) noexcept
+  {
+    return reinterpret_cast<node_type*>(static_cast<std::uintptr_t>(w & ptr_mask));
+  }
+  static word_type pack(node_type* n) noexcept { return reinterpret_cast<std::uintptr_t>(n); }
+  static word_type local_count(word_type w) noexcept { return w >> local_shift; }
+
+  static node_type* make_node(shared_ptr<T>&& r)
+  {
+    if(!r && r.use_count() == 0) {
+      return nullptr;
+    }
+    std::allocator<shared_ptr<T>> alloc;
+    node_type* n = detail::allocate_state<node_type>(alloc, alloc, std::move(r));
+    n->add_shared(-1);  // published nodes start from 0 (see above)
+    return n;
+  }
+
+  static void release_node(node_type* n, word_type local) noexcept
+  {
+    if(n) {
+      n->add_shared(static_cast<int>(local) + 1);
+      n->release();
+    }
+  }
+
+  // returns the word with the local reference of the caller already included
+  word_type acquire_local() const noexcept { return word_.fetch_add(local_one, std::memory_order_acquire) + local_one; }
+
+  void release_local(node_type* n) const noexcept
+  {
+    word_type w = word_.load(std::memory_order_relaxed);
+    while(node(w) == n && local_count(w) != 0) {
+      if(word_.compare_exchange_weak(w, w - local_one, std::memory_order_release, std::memory_order_relaxed)) {
+        return;
+      }
+    }
+    // the node was replaced and our local reference was transferred to its shared counter
+    if(n) {
+      n->release();
+    }
+  }
+
+  static shared_ptr<T> value(node_type* n) { return n ? *n->ptr() : shared_ptr<T>{}; }
+
+public:
+  constexpr atomic_shared_ptr() noexcept = default;
+  atomic_shared_ptr(shared_ptr<T> desired) : word_{pack(make_node(std::move(desired)))} {}
+  atomic_shared_ptr(const atomic_shared_ptr&) = delete;
+  atomic_shared_ptr& operator=(const atomic_shared_ptr&) = delete;
+  ~atomic_shared_ptr() { release_node(node(word_.load(std::memory_order_acquire)), 0); }
+
+  bool is_lock_free() const noexcept { return word_.is_lock_free(); }
+
+  shared_ptr<T> load(std::memory_order = std::memory_order_seq_cst) const noexcept
+  {
+    if(!node(word_.load(std::memory_order_acquire))) {
+      return {};
+    }
+    node_type* n = node(acquire_local());
+    shared_ptr<T> result = value(n);
+    release_local(n);
+    return result;
+  }
+  operator shared_ptr<T>() const noexcept { return load(); }
+
+  shared_ptr<T> exchange(shared_ptr<T> desired, std::memory_order = std::memory_order_seq_cst)
+  {
+    const word_type old = word_.exchange(pack(make_node(std::move(desired))), std::memory_order_acq_rel);
+    shared_ptr<T> result = value(node(old));
+    release_node(node(old), local_count(old));
+    return result;
+  }
+
+  void store(shared_ptr<T> desired, std::memory_order mo = std::memory_order_seq_cst)
+  {
+    exchange(std::move(desired), mo);
+  }
+  atomic_shared_ptr& operator=(shared_ptr<T> desired)
+  {
+    store(std::move(desired));
+    return *this;
+  }
+
+  bool compare_exchange_strong(shared_ptr<T>& expected, shared_ptr<T> desired, std::memory_order,
+                               std::memory_order)
+  {
+    node_type* next = make_node(std::move(desired));
+    for(;;) {
+      word_type w = acquire_local();
+      node_type* current = node(w);
+      shared_ptr<T> actual = value(current);
+      if(!detail::atomic_access::equivalent(actual, expected)) {
+        release_local(current);
+        release_node(next, 0);
+        expected = std::move(actual);
+        return false;
+      }
+      while(node(w) == current) {
+        if(word_.compare_exchange_weak(w, pack(next), std::memory_order_acq_rel, std::memory_order_relaxed)) {
+          // our own local reference dies together with the reference held by this atomic
+          release_node(current, local_count(w) - 1);
+          return true;
+        }
+      }
+      release_local(current);
+    }
+  }
+  bool compare_exchange_weak(shared_ptr<T>& expected, shared_ptr<T> desired, std::memory_order success,
+                             std::memory_order failure)
+  {
+    return compare_exchange_strong(expected, std::move(desired), success, failure);
+  }
+  bool compare_exchange_strong(shared_ptr<T>& expected, shared_ptr<T> desired,
+                               std::memory_order mo = std::memory_order_seq_cst)
+  {
+    return compare_exchange_strong(expected, std::move(desired), mo, mo);
+  }
+  bool compare_exchange_weak(shared_ptr<T>& expected, shared_ptr<T> desired,
+                             std::memory_order mo = std::memory_order_seq_cst)
+  {
+    return compare_exchange_strong(expected, std::move(desired), mo, mo);
+  }
+};
+
 // 20.11.2.7 hash support
 template <class T>
 struct hash;
 //template <class T, class D>
 //struct hash<std::unique_ptr<T, D>>;
-template <class T>
-struct hash<shared_ptr<T>>;
+template <class T, class Counters>
+struct hash<shared_ptr<T, Counters>> {
+  std::size_t operator()(const shared_ptr<T, Counters>& p) const noexcept
+  {
+    return std::hash<decltype(p.get())>{}(p.get());
+  }
+};
+
+// Hashing and equality of shared_ptr and weak_ptr based on ownership to use them as keys of unordered
+// containers. Expired weak_ptr keep their hash and stay equal to the pointers they were created from.
+struct owner_hash {
+  template <class P>
+  std::size_t operator()(const P& p) const noexcept
+  {
+    return p.owner_hash();
+  }
+  using is_transparent = void;
+};
+
+struct owner_equal {
+  template <class P1, class P2>
+  bool operator()(const P1& a, const P2& b) const noexcept
+  {
+    return a.owner_equal(b);
+  }
+  using is_transparent = void;
+};
 
 }  // namespace experimental
 
 namespace std {
 // 20.11.2.2.8, shared_ptr specialized algorithms:
-template <class T>
-void swap(experimental::shared_ptr<T>& a, experimental::shared_ptr<T>& b) noexcept
+template <class T, class Counters>
+void swap(experimental::shared_ptr<T, Counters>& a, experimental::shared_ptr<T, Counters>& b) noexcept
 {
   a.swap(b);
 }
+
+template <class T, class Counters>
+struct hash<experimental::shared_ptr<T, Counters>> : experimental::hash<experimental::shared_ptr<T, Counters>> {
+};
 }
\ No newline at end of file
@@ -0,0 +1,165 @@
+#pragma once
+
+#include "shared_ptr_2.h"
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace experimental {
+
+// Read-mostly value published by a single writer and read without touching the reference counters
+//
+// A reader announces the current epoch in a slot, loads the published snapshot and clears the slot
+// when done. Slots are picked by thread, so a read costs one uncontended compare-and-swap on a cache
+// line no other thread writes to, a few loads and a store. Replaced snapshots are retired with the
+// epoch in which they were replaced and the writer drops its references to them once no reader is
+// left in that epoch or an older one (a grace period). Readers keeping a snapshot after the read
+// section retain it as a shared_ptr.
+//
+// publish(), reclaim() and synchronize() must be called by one thread at a time. At most Readers read
+// sections may be open at the same time, more readers spin until a slot is free.
+template<typename T, typename Counters = atomic_counters, std::size_t Readers = 64>
+class shared_snapshot {
+  static_assert(Readers > 0, "at least one reader slot is needed");
+
+public:
+  using pointer = shared_ptr<const T, Counters>;
+
+private:
+  static constexpr std::size_t cache_line = detail::cache_line_size;
+
+  struct node {
+    pointer ptr;
+    std::uint64_t retired_epoch;
+  };
+
+  // slots are a cache line apart even if the snapshot itself is not aligned to one
+  struct slot {
+    std::atomic<std::uint64_t> epoch{0};  // 0 if no read section is open
+    char padding[cache_line - sizeof(std::atomic<std::uint64_t>)];
+  };
+
+  std::atomic<node*> current_;
+  std::atomic<std::uint64_t> epoch_{1};
+  char padding_[cache_line];
+  slot slots_[Readers];
+  std::vector<std::unique_ptr<node>> retired_;  // used only by the writer
+
+  slot& claim_slot() noexcept
+  {
+    // a stale epoch only makes the reader hold older snapshots back longer
+    const std::uint64_t epoch = epoch_.load();
+    for(std::size_t i = detail::thread_slot();; ++i) {
+      slot& s = slots_[i % Readers];
+      std::uint64_t free = 0;
+      if(s.epoch.load(std::memory_order_relaxed) == 0 && s.epoch.compare_exchange_strong(free, epoch)) {
+        return s;
+      }
+      if(i % Readers == Readers - 1) {
+        std::this_thread::yield();
+      }
+    }
+  }
+
+  // the oldest epoch announced by a reader
+  std::uint64_t oldest_reader() const noexcept
+  {
+    std::uint64_t oldest = std::numeric_limits<std::uint64_t>::max();
+    for(const slot& s : slots_) {
+      const std::uint64_t epoch = s.epoch.load();
+      if(epoch != 0 && epoch < oldest) {
+        oldest = epoch;
+      }
+    }
+    return oldest;
+  }
+
+public:
+  // Read section pinning the snapshot published when it was opened
+  class read_guard {
+    slot* slot_ = nullptr;
+    const node* node_ = nullptr;
+
+    friend class shared_snapshot;
+    read_guard(slot& s, const node* n) noexcept : slot_{&s}, node_{n} {}
+
+  public:
+    read_guard(read_guard&& other) noexcept
+        : slot_{std::exchange(other.slot_, nullptr)}, node_{std::exchange(other.node_, nullptr)}
+    {
+    }
+    read_guard& operator=(read_guard&&) = delete;
+    ~read_guard()
+    {
+      if(slot_) {
+        slot_->epoch.store(0, std::memory_order_release);
+      }
+    }
+
+    // takes a reference to keep the snapshot after the read section is closed
+    pointer retain() const noexcept { return node_->ptr; }
+
+    const T* get() const noexcept { return node_->ptr.get(); }
+    const T& operator*() const noexcept { return *get(); }
+    const T* operator->() const noexcept { return get(); }
+    explicit operator bool() const noexcept { return get() != nullptr; }
+  };
+
+  explicit shared_snapshot(pointer initial = pointer{}) : current_{new node{std::move(initial), 0}} {}
+  shared_snapshot(const shared_snapshot&) = delete;
+  shared_snapshot& operator=(const shared_snapshot&) = delete;
+  ~shared_snapshot() { delete current_.load(std::memory_order_relaxed); }
+
+  read_guard read() noexcept
+  {
+    slot& s = claim_slot();
+    return read_guard{s, current_.load()};
+  }
+
+  // returns an owning pointer to the current snapshot
+  pointer load() noexcept { return read().retain(); }
+
+  // replaces the current snapshot, the old one is released after a grace period
+  void publish(pointer ptr)
+  {
+    std::unique_ptr<node> replacement{new node{std::move(ptr), 0}};
+    retired_.reserve(retired_.size() + 1);
+    std::unique_ptr<node> old{current_.exchange(replacement.release())};
+    old->retired_epoch = epoch_.fetch_add(1);
+    retired_.push_back(std::move(old));
+    reclaim();
+  }
+
+  // releases the snapshots whose grace period has elapsed and returns the number of them
+  std::size_t reclaim() noexcept
+  {
+    if(retired_.empty()) {
+      return 0;
+    }
+    const std::uint64_t oldest = oldest_reader();
+    const std::size_t count = retired_.size();
+    retired_.erase(std::remove_if(retired_.begin(), retired_.end(),
+                                  [oldest](const std::unique_ptr<node>& n) { return n->retired_epoch < oldest; }),
+                   retired_.end());
+    return count - retired_.size();
+  }
+
+  // waits until all replaced snapshots are released
+  void synchronize() noexcept
+  {
+    while(reclaim(), !retired_.empty()) {
+      std::this_thread::yield();
+    }
+  }
+
+  // number of replaced snapshots still waiting for their grace period
+  std::size_t retired() const noexcept { return retired_.size(); }
+};
+
+}  // namespace experimental
@@ -0,0 +1,142 @@
+// FreeTTCN is a free compiler and execution environment for TTCN-3 language.
+//
+// Copyright (C) 2016 Mateusz Pusz
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "shared_ptr_2.h"
+#include <gtest/gtest.h>
+#include <utility>
+
+#ifndef SHARED_PTR_2_INSTRUMENTATION
+#error "instrumentation tests have to be built with SHARED_PTR_2_INSTRUMENTATION"
+#endif
+
+using experimental::instrumentation::take_snapshot;
+using experimental::instrumentation::live_states;
+
+namespace {
+
+struct object {
+  int value = 0;
+};
+
+struct intrusive_object : experimental::intrusive_ref_base<intrusive_object> {
+  int value = 0;
+};
+
+}
+
+TEST(instrumentation, makeShared)
+{
+  const auto before = take_snapshot();
+  {
+    auto ptr = experimental::make_shared<int>(1);
+    const auto traffic = take_snapshot() - before;
+    EXPECT_EQ(1, traffic.allocations);
+    EXPECT_EQ(1, traffic.live_states);
+    EXPECT_EQ(1, live_states<int*>());
+    EXPECT_EQ(0, traffic.shared_increments);
+  }
+  const auto traffic = take_snapshot() - before;
+  EXPECT_EQ(0, traffic.live_states);
+  EXPECT_EQ(0, live_states<int*>());
+  EXPECT_EQ(1, traffic.shared_decrements);
+  EXPECT_EQ(1, traffic.weak_decrements);
+}
+
+TEST(instrumentation, constructorPtr)
+{
+  const auto before = take_snapshot();
+  {
+    experimental::shared_ptr<object> ptr{new object};
+    EXPECT_EQ(1, live_states<object*>());
+    EXPECT_EQ(1, (take_snapshot() - before).allocations);
+  }
+  EXPECT_EQ(0, live_states<object*>());
+}
+
+TEST(instrumentation, copyAndMove)
+{
+  auto ptr = experimental::make_shared<object>();
+  const auto before = take_snapshot();
+  {
+    experimental::shared_ptr<object> copy{ptr};
+    experimental::shared_ptr<object> moved{std::move(copy)};
+  }
+  const auto traffic = take_snapshot() - before;
+  EXPECT_EQ(1, traffic.shared_increments);
+  EXPECT_EQ(1, traffic.shared_decrements);
+  EXPECT_EQ(0, traffic.weak_increments);
+  EXPECT_EQ(0, traffic.allocations);
+}
+
+TEST(instrumentation, weakLock)
+{
+  auto ptr = experimental::make_shared<object>();
+  experimental::weak_ptr<object> weak{ptr};
+  const auto before = take_snapshot();
+  {
+    auto locked = weak.lock();
+    experimental::weak_ptr<object> copy{weak};
+  }
+  const auto traffic = take_snapshot() - before;
+  EXPECT_EQ(1, traffic.shared_increments);
+  EXPECT_EQ(1, traffic.shared_decrements);
+  EXPECT_EQ(1, traffic.weak_increments);
+  EXPECT_EQ(1, traffic.weak_decrements);
+}
+
+TEST(instrumentation, intrusiveNeedsNoAllocation)
+{
+  const auto before = take_snapshot();
+  {
+    auto ptr = experimental::make_intrusive<intrusive_object>();
+    EXPECT_EQ(1, live_states<intrusive_object*>());
+    experimental::intrusive_weak_ptr<intrusive_object> weak{ptr};
+  }
+  const auto traffic = take_snapshot() - before;
+  EXPECT_EQ(0, traffic.allocations);
+  EXPECT_EQ(0, traffic.live_states);
+  EXPECT_EQ(0, live_states<intrusive_object*>());
+}
+
+TEST(instrumentation, uniqueShareable)
+{
+  auto unique = experimental::make_unique_shareable<object>();
+  const auto before = take_snapshot();
+  {
+    experimental::shared_ptr<object, experimental::atomic_counters> shared = std::move(unique).share();
+    const auto traffic = take_snapshot() - before;
+    EXPECT_EQ(0, traffic.allocations);
+    EXPECT_EQ(0, traffic.shared_increments);
+  }
+  EXPECT_EQ(0, live_states<object*>());
+}
+
+TEST(instrumentation, borrowedPtr)
+{
+  auto ptr = experimental::make_shared<object>();
+  const auto before = take_snapshot();
+  {
+    experimental::borrowed_ptr<object> borrowed = ptr;
+    experimental::borrowed_ptr<object> copy = borrowed;
+    EXPECT_EQ(0, copy->value);
+    EXPECT_EQ(0, (take_snapshot() - before).shared_increments);
+    auto retained = copy.retain();
+    EXPECT_EQ(1, (take_snapshot() - before).shared_increments);
+  }
+  EXPECT_EQ(1, (take_snapshot() - before).shared_decrements);
+}
@@ -16,8 +16,18 @@
 // along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include "shared_ptr_2.h"
+#include "control_block_pool.h"
+#include "deferred_reclamation.h"
+#include "relocation.h"
+#include "shared_snapshot.h"
 #include <gtest/gtest.h>
+#include <iterator>
 #include <memory>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 template<typename T>
 using weak_ptr = experimental::weak_ptr<T>;
@@ -25,6 +35,12 @@ using weak_ptr = experimental::weak_ptr<T>;
 template<typename T>
 using shared_ptr = experimental::shared_ptr<T>;
 
+template<typename T>
+using intrusive_ptr = experimental::intrusive_ptr<T>;
+
+template<typename T>
+using intrusive_weak_ptr = experimental::intrusive_weak_ptr<T>;
+
 
 namespace {
 
@@ -74,228 +90,1711 @@ struct test_allocator {
     }
     ::operator delete(p);
   }
-};
+};
+
+template <class T1, class T2>
+bool operator==(const test_allocator<T1>& lhs, const test_allocator<T2>& rhs)
+{
+  return true;
+}
+
+template <class T1, class T2>
+bool operator!=(const test_allocator<T1>& lhs, const test_allocator<T2>& rhs)
+{
+  return std::rel_ops::operator!=(lhs, rhs);
+}
+
+struct tracked {
+  int value;
+  test_state* state;
+
+  tracked(int v, test_state* s) : value{v}, state{s} {}
+  ~tracked() { ++state->deleter_count; }
+};
+
+struct concurrent_tracked {
+  int value;
+  std::atomic<int>* destroyed;
+
+  concurrent_tracked(int v, std::atomic<int>* d) : value{v}, destroyed{d} {}
+  ~concurrent_tracked() { ++*destroyed; }
+};
+
+struct self_aware : experimental::enable_shared_from_this<self_aware> {
+  int value = 1;
+};
+
+struct embedded : experimental::embedded_shared_from_this<embedded> {
+  test_state* state;
+
+  explicit embedded(test_state* s) : state{s} {}
+  ~embedded() { ++state->deleter_count; }
+};
+
+struct embedded_base : experimental::embedded_shared_from_this<embedded_base> {
+  test_state* state;
+
+  explicit embedded_base(test_state* s) : state{s} {}
+  virtual ~embedded_base() { ++state->deleter_count; }
+};
+
+struct other_base {
+  virtual ~other_base() = default;
+  int value = 1;
+};
+
+struct embedded_derived final : other_base, embedded_base {
+  explicit embedded_derived(test_state* s) : embedded_base{s} {}
+};
+
+struct embedded_class_delete : experimental::embedded_shared_from_this<embedded_class_delete> {
+  static int deletes;
+
+  static void* operator new(std::size_t size) { return ::operator new(size); }
+  static void operator delete(void* p, std::size_t size)
+  {
+    ++deletes;
+    ::operator delete(p, size);
+  }
+};
+int embedded_class_delete::deletes = 0;
+
+struct copy_limited {
+  int* copies_left;
+  int* destroyed;
+
+  copy_limited(int* c, int* d) : copies_left{c}, destroyed{d} {}
+  copy_limited(const copy_limited& other) : copies_left{other.copies_left}, destroyed{other.destroyed}
+  {
+    if((*copies_left)-- == 0) {
+      throw std::runtime_error{"copy"};
+    }
+  }
+  ~copy_limited() { ++*destroyed; }
+};
+
+struct intrusive_node : experimental::intrusive_ref_base<intrusive_node> {
+  test_state* state;
+  experimental::intrusive_ptr<intrusive_node> next;
+
+  explicit intrusive_node(test_state* s) : state{s} {}
+  ~intrusive_node() { ++state->deleter_count; }
+};
+
+struct intrusive_leaf : intrusive_node {
+  int value = 2;
+
+  using intrusive_node::intrusive_node;
+};
+
+struct opted_in : experimental::embedded_shared_from_this<opted_in> {
+  int value = 3;
+};
+}
+
+
+
+TEST(shared_ptr, defaultConstructor)
+{
+  shared_ptr<A> ptr;
+  EXPECT_EQ(0, ptr.use_count());
+  EXPECT_EQ(nullptr, ptr.get());
+}
+
+TEST(shared_ptr, constructorPtr)
+{
+  A* p = new A;
+  shared_ptr<A> ptr{p};
+  EXPECT_EQ(1, ptr.use_count());
+  EXPECT_EQ(p, ptr.get());
+}
+
+TEST(shared_ptr, constructorPtrDeleter)
+{
+  test_state state;
+  test_deleter<A> deleter{&state};
+  {
+    A* p = new A;
+    shared_ptr<A> ptr{p, deleter};
+    EXPECT_EQ(1, ptr.use_count());
+    EXPECT_EQ(p, ptr.get());
+    EXPECT_EQ(0, state.deleter_count);
+  }
+  EXPECT_EQ(1, state.deleter_count);
+}
+
+TEST(shared_ptr, constructorPtrDeleterAllocator)
+{
+  test_state state;
+  test_allocator<A> allocator{&state};
+  test_deleter<A> deleter{&state};
+  {
+    A* p = new A;
+    shared_ptr<A> ptr{p, deleter, allocator};
+    EXPECT_EQ(1, ptr.use_count());
+    EXPECT_EQ(p, ptr.get());
+    EXPECT_EQ(0, state.deleter_count);
+    EXPECT_NE(0, state.allocated_bytes);
+    EXPECT_EQ(0, state.deallocated_bytes);
+  }
+  EXPECT_EQ(1, state.deleter_count);
+  EXPECT_NE(0, state.allocated_bytes);
+  EXPECT_EQ(state.allocated_bytes, state.deallocated_bytes);
+  std::cout << "Allocated size: " << state.allocated_bytes << "\n";
+}
+
+TEST(shared_ptr, constructorNullptrDeleter)
+{
+  test_state state;
+  test_deleter<A> deleter{&state};
+  {
+    shared_ptr<A> ptr{nullptr, deleter};
+    EXPECT_EQ(1, ptr.use_count());
+    EXPECT_EQ(nullptr, ptr.get());
+    EXPECT_EQ(0, state.deleter_count);
+  }
+  EXPECT_EQ(1, state.deleter_count);
+}
+
+TEST(shared_ptr, constructorNullptrDeleterAllocator)
+{
+  test_state state;
+  test_allocator<A> allocator{&state};
+  test_deleter<A> deleter{&state};
+  {
+    shared_ptr<A> ptr{nullptr, deleter, allocator};
+    EXPECT_EQ(1, ptr.use_count());
+    EXPECT_EQ(nullptr, ptr.get());
+    EXPECT_EQ(0, state.deleter_count);
+    EXPECT_NE(0, state.allocated_bytes);
+    EXPECT_EQ(0, state.deallocated_bytes);
+  }
+  EXPECT_EQ(1, state.deleter_count);
+  EXPECT_NE(0, state.allocated_bytes);
+  EXPECT_EQ(state.allocated_bytes, state.deallocated_bytes);
+  std::cout << "Allocated size: " << state.allocated_bytes << "\n";
+}
+
+TEST(shared_ptr, constructorAliasing)
+{
+  shared_ptr<B> p1{new B};
+  shared_ptr<B> p2{p1};
+  int val;
+  shared_ptr<int> ptr(p1, &val);
+  EXPECT_EQ(&val, ptr.get());
+  EXPECT_EQ(p1.use_count(), ptr.use_count());
+}
+
+TEST(shared_ptr, constructorAliasingNull)
+{
+  shared_ptr<B> p1{new B};
+  shared_ptr<B> p2{p1};
+  shared_ptr<A> ptr(p1, nullptr);
+  EXPECT_EQ(nullptr, ptr.get());
+  EXPECT_FALSE(ptr);
+  EXPECT_EQ(p1.use_count(), ptr.use_count());
+}
+
+TEST(shared_ptr, constructorAliasingEmpty)
+{
+  shared_ptr<B> p1;
+  int val;
+  shared_ptr<int> ptr(p1, &val);
+  EXPECT_EQ(&val, ptr.get());
+  EXPECT_TRUE(static_cast<bool>(ptr));
+  EXPECT_EQ(0, p1.use_count());
+  EXPECT_EQ(p1.use_count(), ptr.use_count());
+}
+
+// add tests for copy-construction/assignment to aliasing ptr
+
+TEST(shared_ptr, copyConstructor)
+{
+  shared_ptr<A> p{new A};
+  shared_ptr<A> ptr{p};
+  EXPECT_EQ(p.get(), ptr.get());
+  EXPECT_EQ(p.use_count(), ptr.use_count());
+  EXPECT_EQ(2, ptr.use_count());
+}
+
+TEST(shared_ptr, copyConstructorEmpty)
+{
+  shared_ptr<A> p;
+  shared_ptr<A> ptr{p};
+  EXPECT_EQ(p.get(), ptr.get());
+  EXPECT_EQ(p.use_count(), ptr.use_count());
+  EXPECT_EQ(0, ptr.use_count());
+}
+
+TEST(shared_ptr, copyConstructorOtherType)
+{
+  shared_ptr<B> p{new B};
+  shared_ptr<A> ptr{p};
+  EXPECT_EQ(p.get(), ptr.get());
+  EXPECT_EQ(p.use_count(), ptr.use_count());
+  EXPECT_EQ(2, ptr.use_count());
+}
+
+TEST(shared_ptr, copyConstructorOtherTypeEmpty)
+{
+  shared_ptr<B> p;
+  shared_ptr<A> ptr{p};
+  EXPECT_EQ(p.get(), ptr.get());
+  EXPECT_EQ(p.use_count(), ptr.use_count());
+  EXPECT_EQ(0, ptr.use_count());
+}
+
+TEST(shared_ptr, moveConstructor)
+{
+  A* p1 = new A;
+  shared_ptr<A> p{p1};
+  shared_ptr<A> ptr{std::move(p)};
+  EXPECT_EQ(p1, ptr.get());
+  EXPECT_EQ(nullptr, p.get());
+  EXPECT_EQ(0, p.use_count());
+  EXPECT_FALSE(p);
+  EXPECT_EQ(1, ptr.use_count());
+}
+
+TEST(shared_ptr, moveConstructorEmpty)
+{
+  shared_ptr<A> p;
+  shared_ptr<A> ptr{std::move(p)};
+  EXPECT_EQ(nullptr, ptr.get());
+  EXPECT_EQ(nullptr, p.get());
+  EXPECT_EQ(0, p.use_count());
+  EXPECT_FALSE(p);
+  EXPECT_EQ(0, ptr.use_count());
+}
+
+TEST(shared_ptr, moveConstructorOtherType)
+{
+  B* p1 = new B;
+  shared_ptr<B> p{p1};
+  shared_ptr<A> ptr{std::move(p)};
+  EXPECT_EQ(p1, ptr.get());
+  EXPECT_EQ(nullptr, p.get());
+  EXPECT_EQ(0, p.use_count());
+  EXPECT_FALSE(p);
+  EXPECT_EQ(1, ptr.use_count());
+}
+
+TEST(shared_ptr, moveConstructorOtherTypeEmpty)
+{
+  shared_ptr<B> p;
+  shared_ptr<A> ptr{std::move(p)};
+  EXPECT_EQ(p.get(), ptr.get());
+  EXPECT_EQ(nullptr, p.get());
+  EXPECT_EQ(0, p.use_count());
+  EXPECT_FALSE(p);
+  EXPECT_EQ(0, ptr.use_count());
+}
+
+TEST(shared_ptr, constructorFromWeak)
+{
+  shared_ptr<B> p1{new B};
+  experimental::weak_ptr<B> p2{p1};
+  shared_ptr<A> ptr{p2};
+  EXPECT_EQ(p2.use_count(), ptr.use_count());
+  EXPECT_EQ(2, ptr.use_count());
+}
+
+TEST(shared_ptr, constructorFromExpiredWeak)
+{
+  weak_ptr<B> w;
+  {
+    shared_ptr<B> p{new B};
+    w = p;
+  }
+  EXPECT_TRUE(w.expired());
+  EXPECT_THROW(shared_ptr<A>{w}, std::bad_weak_ptr);
+}
+
+TEST(shared_ptr, makeShared)
+{
+  test_state state;
+  {
+    auto ptr = experimental::make_shared<tracked>(42, &state);
+    EXPECT_EQ(1, ptr.use_count());
+    EXPECT_EQ(42, ptr.get()->value);
+    EXPECT_EQ(0, state.deleter_count);
+  }
+  EXPECT_EQ(1, state.deleter_count);
+}
+
+TEST(shared_ptr, makeSharedConst)
+{
+  auto ptr = experimental::make_shared<const int>(42);
+  EXPECT_EQ(42, *ptr.get());
+}
+
+TEST(shared_ptr, makeSharedWeakOutlivesObject)
+{
+  test_state state;
+  weak_ptr<tracked> w;
+  {
+    auto ptr = experimental::make_shared<tracked>(1, &state);
+    w = ptr;
+    EXPECT_EQ(1, w.use_count());
+  }
+  EXPECT_EQ(1, state.deleter_count);
+  EXPECT_EQ(0, w.use_count());
+}
+
+TEST(shared_ptr, allocateSharedSingleAllocation)
+{
+  test_state state;
+  test_allocator<tracked> allocator{&state};
+  {
+    auto ptr = experimental::allocate_shared<tracked>(allocator, 7, &state);
+    shared_ptr<tracked> copy{ptr};
+    EXPECT_EQ(2, ptr.use_count());
+    EXPECT_EQ(7, copy.get()->value);
+    EXPECT_EQ(1, state.allocated_bytes);
+    EXPECT_EQ(0, state.deallocated_bytes);
+  }
+  EXPECT_EQ(1, state.deleter_count);
+  EXPECT_EQ(1, state.allocated_bytes);
+  EXPECT_EQ(1, state.deallocated_bytes);
+}
+
+
+TEST(shared_ptr, atomicLoadStore)
+{
+  shared_ptr<int> p{new int{1}};
+  EXPECT_FALSE(experimental::atomic_is_lock_free(&p));
+  shared_ptr<int> copy = experimental::atomic_load(&p);
+  EXPECT_EQ(p.get(), copy.get());
+  EXPECT_EQ(2, p.use_count());
+
+  int* n = new int{2};
+  experimental::atomic_store(&p, shared_ptr<int>{n});
+  EXPECT_EQ(n, p.get());
+  EXPECT_EQ(1, p.use_count());
+  EXPECT_EQ(1, copy.use_count());
+}
+
+TEST(shared_ptr, atomicCompareExchange)
+{
+  shared_ptr<int> p{new int{1}};
+  shared_ptr<int> expected{new int{2}};
+  shared_ptr<int> desired{new int{3}};
+  EXPECT_FALSE(experimental::atomic_compare_exchange_strong(&p, &expected, desired));
+  EXPECT_EQ(p.get(), expected.get());
+  EXPECT_TRUE(experimental::atomic_compare_exchange_strong(&p, &expected, desired));
+  EXPECT_EQ(desired.get(), p.get());
+  EXPECT_EQ(2, desired.use_count());
+  EXPECT_EQ(1, expected.use_count());
+}
+
+TEST(state, noVirtualDispatch)
+{
+  using state_type = experimental::detail::state<experimental::atomic_counters, A*>;
+  EXPECT_FALSE(std::is_polymorphic<state_type>::value);
+  EXPECT_EQ(sizeof(void*) + sizeof(experimental::atomic_counters) + sizeof(A*), sizeof(state_type));
+}
+
+TEST(state, trivialObjectWithWeak)
+{
+  weak_ptr<int> w;
+  {
+    auto ptr = experimental::make_shared<int>(42);
+    w = ptr;
+    EXPECT_EQ(42, *w.lock().get());
+  }
+  EXPECT_TRUE(w.expired());
+}
+
+TEST(local_shared_ptr, constructorPtrDeleter)
+{
+  test_state state;
+  test_deleter<A> deleter{&state};
+  {
+    A* p = new A;
+    experimental::local_shared_ptr<A> ptr{p, deleter};
+    experimental::local_shared_ptr<A> copy{ptr};
+    EXPECT_EQ(2, ptr.use_count());
+    EXPECT_EQ(p, copy.get());
+  }
+  EXPECT_EQ(1, state.deleter_count);
+}
+
+TEST(local_shared_ptr, makeLocalShared)
+{
+  test_state state;
+  experimental::local_weak_ptr<tracked> w;
+  {
+    auto ptr = experimental::make_local_shared<tracked>(3, &state);
+    w = ptr;
+    experimental::local_shared_ptr<tracked> locked = w.lock();
+    EXPECT_EQ(ptr.get(), locked.get());
+    EXPECT_EQ(2, ptr.use_count());
+  }
+  EXPECT_EQ(1, state.deleter_count);
+  EXPECT_EQ(0, w.use_count());
+}
+
+TEST(local_shared_ptr, convertible)
+{
+  experimental::local_shared_ptr<B> b{new B};
+  experimental::local_shared_ptr<A> a{b};
+  experimental::local_weak_ptr<A> w{b};
+  EXPECT_EQ(2, a.use_count());
+  EXPECT_EQ(2, w.use_count());
+}
+
+TEST(packed_counters, singleWord)
+{
+  EXPECT_EQ(8u, sizeof(experimental::packed_counters));
+}
+
+TEST(packed_counters, sharedAndWeak)
+{
+  test_state state;
+  test_deleter<A> deleter{&state};
+  {
+    experimental::shared_ptr<A, experimental::packed_counters> ptr{new A, deleter};
+    experimental::shared_ptr<A, experimental::packed_counters> copy{ptr};
+    experimental::weak_ptr<A, experimental::packed_counters> w{ptr};
+    EXPECT_EQ(2, w.use_count());
+    copy = w.lock();
+    EXPECT_EQ(2, ptr.use_count());
+    ptr = nullptr;
+    copy = nullptr;
+    EXPECT_EQ(1, state.deleter_count);
+    EXPECT_EQ(0, w.use_count());
+    EXPECT_EQ(nullptr, w.lock().get());
+  }
+  EXPECT_EQ(1, state.deleter_count);
+}
+
+TEST(packed_counters, makeSharedWith)
+{
+  test_state state;
+  {
+    auto ptr = experimental::make_shared_with<tracked, experimental::packed_counters>(5, &state);
+    EXPECT_EQ(5, ptr.get()->value);
+    EXPECT_EQ(1, ptr.use_count());
+  }
+  EXPECT_EQ(1, state.deleter_count);
+}
+
+TEST(sharded_counters, sameThread)
+{
+  test_state state;
+  experimental::weak_ptr<tracked, experimental::sharded_counters<>> w;
+  {
+    auto ptr = experimental::make_shared_with<tracked, experimental::sharded_counters<>>(1, &state);
+    auto copy = ptr;
+    w = ptr;
+    EXPECT_EQ(2, ptr.use_count());
+    EXPECT_EQ(1, w.lock().get()->value);
+  }
+  EXPECT_EQ(1, state.deleter_count);
+  EXPECT_TRUE(w.expired());
+  EXPECT_EQ(nullptr, w.lock().get());
+}
+
+TEST(sharded_counters, releasedByOtherThreads)
+{
+  test_state state;
+  using ptr_type = experimental::shared_ptr<tracked, experimental::sharded_counters<2>>;
+  auto ptr = experimental::make_shared_with<tracked, experimental::sharded_counters<2>>(1, &state);
+  std::vector<ptr_type> copies(8, ptr);
+  std::thread{[&] {
+    auto local = ptr;
+    copies.clear();
+    ptr = nullptr;
+    EXPECT_EQ(1, local.use_count());
+  }}.join();
+  EXPECT_EQ(1, state.deleter_count);
+}
+
+TEST(sharded_counters, concurrentCopies)
+{
+  std::atomic<int> destroyed{0};
+  {
+    auto ptr = experimental::make_shared_with<concurrent_tracked, experimental::sharded_counters<4>>(1, &destroyed);
+    std::vector<experimental::shared_ptr<concurrent_tracked, experimental::sharded_counters<4>>> handed(8, ptr);
+    std::vector<std::thread> threads;
+    for(int i = 0; i < 8; ++i) {
+      threads.emplace_back([ptr, p = std::move(handed[i])]() mutable {
+        for(int j = 0; j < 10000; ++j) {
+          auto copy = ptr;
+          EXPECT_EQ(1, copy.get()->value);
+        }
+        p = nullptr;
+      });
+    }
+    for(auto& t : threads) {
+      t.join();
+    }
+    EXPECT_EQ(0, destroyed);
+    EXPECT_EQ(1, ptr.use_count());
+  }
+  EXPECT_EQ(1, destroyed);
+}
+
+TEST(padded_counters, cacheLinesOfTheirOwn)
+{
+  static_assert(sizeof(experimental::padded_counters<>) >= 2 * 64 + sizeof(experimental::atomic_counters), "");
+  test_state state;
+  experimental::weak_ptr<tracked, experimental::padded_counters<>> w;
+  {
+    auto ptr = experimental::make_shared_with<tracked, experimental::padded_counters<>>(1, &state);
+    auto copy = ptr;
+    w = ptr;
+    EXPECT_EQ(2, ptr.use_count());
+    EXPECT_EQ(1, w.lock().get()->value);
+  }
+  EXPECT_EQ(1, state.deleter_count);
+  EXPECT_TRUE(w.expired());
+}
+
+TEST(padded_counters, anyPolicy)
+{
+  test_state state;
+  {
+    using counters = experimental::padded_counters<experimental::biased_counters>;
+    experimental::shared_ptr<tracked, counters> ptr{new tracked{1, &state}};
+    auto copy = ptr;
+    EXPECT_EQ(2, ptr.use_count());
+  }
+  EXPECT_EQ(1, state.deleter_count);
+}
+
+TEST(biased_counters, ownerThread)
+{
+  test_state state;
+  experimental::weak_ptr<tracked, experimental::biased_counters> w;
+  {
+    auto ptr = experimental::make_shared_with<tracked, experimental::biased_counters>(1, &state);
+    auto copy = ptr;
+    w = ptr;
+    EXPECT_EQ(2, ptr.use_count());
+    EXPECT_EQ(1, w.lock().get()->value);
+  }
+  EXPECT_EQ(1, state.deleter_count);
+  EXPECT_TRUE(w.expired());
+}
+
+TEST(biased_counters, lastReleaseOnOtherThread)
+{
+  test_state state;
+  auto ptr = experimental::make_shared_with<tracked, experimental::biased_counters>(1, &state);
+  std::thread{[p = std::move(ptr)]() mutable { p = nullptr; }}.join();
+  EXPECT_EQ(0, state.deleter_count);
+  EXPECT_EQ(1u, experimental::biased_counters::merge_queued());
+  EXPECT_EQ(1, state.deleter_count);
+}
+
+TEST(biased_counters, revivedBeforeMerge)
+{
+  test_state state;
+  auto ptr = experimental::make_shared_with<tracked, experimental::biased_counters>(1, &state);
+  experimental::weak_ptr<tracked, experimental::biased_counters> w{ptr};
+  std::thread{[p = std::move(ptr)]() mutable { p = nullptr; }}.join();
+  auto revived = w.lock();
+  EXPECT_EQ(1, revived.get()->value);
+  experimental::biased_counters::merge_queued();
+  EXPECT_EQ(0, state.deleter_count);
+  revived = nullptr;
+  EXPECT_EQ(1, state.deleter_count);
+}
+
+TEST(biased_counters, ownerExited)
+{
+  test_state state;
+  experimental::shared_ptr<tracked, experimental::biased_counters> ptr;
+  std::thread{[&] {
+    ptr = experimental::make_shared_with<tracked, experimental::biased_counters>(1, &state);
+  }}.join();
+  EXPECT_EQ(1, ptr.use_count());
+  ptr = nullptr;
+  EXPECT_EQ(1, state.deleter_count);
+}
+
+TEST(biased_counters, concurrentCopies)
+{
+  std::atomic<int> destroyed{0};
+  {
+    auto ptr = experimental::make_shared_with<concurrent_tracked, experimental::biased_counters>(1, &destroyed);
+    std::vector<std::thread> threads;
+    for(int i = 0; i < 4; ++i) {
+      threads.emplace_back([ptr] {
+        for(int j = 0; j < 10000; ++j) {
+          auto copy = ptr;
+          EXPECT_EQ(1, copy.get()->value);
+        }
+      });
+    }
+    for(int j = 0; j < 10000; ++j) {
+      auto copy = ptr;
+    }
+    for(auto& t : threads) {
+      t.join();
+    }
+    EXPECT_EQ(1, ptr.use_count());
+  }
+  // references copied here were released by the other threads and the owner merged them on its last release
+  EXPECT_EQ(1, destroyed);
+  EXPECT_EQ(0u, experimental::biased_counters::merge_queued());
+}
+
+TEST(biased_counters, mergedWhenOwnerCreatesBlock)
+{
+  test_state state;
+  auto ptr = experimental::make_shared_with<tracked, experimental::biased_counters>(1, &state);
+  std::thread{[p = std::move(ptr)]() mutable { p = nullptr; }}.join();
+  EXPECT_EQ(0, state.deleter_count);
+  auto other = experimental::make_shared_with<int, experimental::biased_counters>(2);
+  EXPECT_EQ(1, state.deleter_count);
+  EXPECT_EQ(0u, experimental::biased_counters::merge_queued());
+}
+
+TEST(biased_counters, noRecordForNonOwner)
+{
+  auto ptr = experimental::make_shared_with<int, experimental::biased_counters>(1);
+  std::thread{[&ptr] {
+    auto copy = ptr;
+    experimental::weak_ptr<int, experimental::biased_counters> w{copy};
+    copy = nullptr;
+    EXPECT_EQ(1, *w.lock());
+    EXPECT_EQ(0u, experimental::biased_counters::merge_queued());
+    EXPECT_EQ(nullptr, experimental::detail::biased_owner::peek());
+  }}.join();
+  EXPECT_EQ(1, ptr.use_count());
+}
+
+TEST(atomic_shared_ptr, loadStore)
+{
+  experimental::atomic_shared_ptr<int> a;
+  EXPECT_TRUE(a.is_lock_free());
+  EXPECT_EQ(nullptr, a.load().get());
+
+  shared_ptr<int> p{new int{1}};
+  a.store(p);
+  EXPECT_EQ(2, p.use_count());
+  shared_ptr<int> copy = a.load();
+  EXPECT_EQ(p.get(), copy.get());
+  EXPECT_EQ(3, p.use_count());
+
+  shared_ptr<int> old = a.exchange(nullptr);
+  EXPECT_EQ(p.get(), old.get());
+  EXPECT_EQ(3, p.use_count());
+  EXPECT_EQ(nullptr, a.load().get());
+}
+
+TEST(atomic_shared_ptr, compareExchange)
+{
+  shared_ptr<int> p{new int{1}};
+  shared_ptr<int> q{new int{2}};
+  experimental::atomic_shared_ptr<int> a{p};
+  shared_ptr<int> expected = q;
+  EXPECT_FALSE(a.compare_exchange_strong(expected, q));
+  EXPECT_EQ(p.get(), expected.get());
+  EXPECT_TRUE(a.compare_exchange_strong(expected, q));
+  EXPECT_EQ(q.get(), a.load().get());
+  EXPECT_EQ(2, p.use_count());
+}
+
+TEST(atomic_shared_ptr, concurrentReadersAndWriter)
+{
+  std::atomic<int> destroyed{0};
+  {
+    experimental::atomic_shared_ptr<concurrent_tracked> a{experimental::make_shared<concurrent_tracked>(0, &destroyed)};
+    std::atomic<bool> done{false};
+    std::vector<std::thread> readers;
+    for(int i = 0; i < 4; ++i) {
+      readers.emplace_back([&] {
+        while(!done) {
+          auto p = a.load();
+          EXPECT_NE(nullptr, p.get());
+        }
+      });
+    }
+    for(int i = 1; i <= 1000; ++i) {
+      a.store(experimental::make_shared<concurrent_tracked>(i, &destroyed));
+    }
+    done = true;
+    for(auto& t : readers) {
+      t.join();
+    }
+    EXPECT_EQ(1000, a.load().get()->value);
+  }
+  EXPECT_EQ(1001, destroyed);
+}
+
+TEST(shared_ptr_array, constructorPtr)
+{
+  shared_ptr<int[]> ptr{new int[4]{1, 2, 3, 4}};
+  EXPECT_EQ(1, ptr.use_count());
+  EXPECT_EQ(3, ptr[2]);
+  ptr[2] = 5;
+  EXPECT_EQ(5, ptr.get()[2]);
+}
+
+TEST(shared_ptr_array, constructorUniquePtr)
+{
+  std::unique_ptr<int[]> u{new int[3]{1, 2, 3}};
+  shared_ptr<const int[]> ptr{std::move(u)};
+  EXPECT_EQ(nullptr, u.get());
+  EXPECT_EQ(3, ptr[2]);
+}
+
+TEST(shared_ptr_array, makeShared)
+{
+  auto ptr = experimental::make_shared<float[]>(100);
+  EXPECT_EQ(0u, reinterpret_cast<std::uintptr_t>(ptr.get()) % experimental::detail::simd_alignment);
+  for(int i = 0; i < 100; ++i) {
+    EXPECT_EQ(0.0f, ptr[i]);
+  }
+  weak_ptr<float[]> w{ptr};
+  EXPECT_EQ(ptr.get(), w.lock().get());
+}
+
+TEST(shared_ptr_array, makeSharedValue)
+{
+  auto ptr = experimental::make_shared<float[]>(5, 1.5f);
+  for(int i = 0; i < 5; ++i) {
+    EXPECT_EQ(1.5f, ptr[i]);
+  }
+}
+
+TEST(shared_ptr_array, makeSharedBounded)
+{
+  auto zeros = experimental::make_shared<int[4]>();
+  EXPECT_EQ(0, zeros[3]);
+  auto sevens = experimental::make_shared<int[4]>(7);
+  EXPECT_EQ(7, sevens[0]);
+  EXPECT_EQ(7, sevens[3]);
+}
+
+TEST(shared_ptr_array, makeSharedMultidimensional)
+{
+  const int init[2] = {1, 2};
+  auto ptr = experimental::make_shared<int[][2]>(3, init);
+  EXPECT_EQ(1, ptr[2][0]);
+  EXPECT_EQ(2, ptr[2][1]);
+}
+
+TEST(shared_ptr_array, allocateSharedSingleAllocation)
+{
+  test_state state;
+  {
+    auto ptr = experimental::allocate_shared<std::int64_t[]>(test_allocator<std::int64_t>{&state}, 10);
+    EXPECT_EQ(0, ptr[9]);
+    EXPECT_GE(state.allocated_bytes, static_cast<int>(10 * sizeof(std::int64_t)));
+  }
+  EXPECT_EQ(state.allocated_bytes, state.deallocated_bytes);
+}
+
+TEST(shared_ptr_array, makeSharedDestroysElements)
+{
+  test_state state;
+  {
+    tracked init{1, &state};
+    {
+      auto ptr = experimental::make_shared<tracked[]>(3, init);
+      EXPECT_EQ(1, ptr[2].value);
+    }
+    EXPECT_EQ(3, state.deleter_count);
+  }
+  EXPECT_EQ(4, state.deleter_count);
+}
+
+TEST(shared_ptr_array, makeSharedThrowingElement)
+{
+  int copies_left = 2;
+  int destroyed = 0;
+  {
+    copy_limited init{&copies_left, &destroyed};
+    EXPECT_THROW(experimental::make_shared<copy_limited[]>(5, init), std::runtime_error);
+    EXPECT_EQ(2, destroyed);
+  }
+  EXPECT_EQ(3, destroyed);
+}
+
+TEST(deferred_deleter, deletesOnDrain)
+{
+  test_state state;
+  experimental::reclamation_queue queue;
+  {
+    shared_ptr<tracked> ptr{new tracked{1, &state}, experimental::defer_deletion<tracked>(queue)};
+    shared_ptr<tracked> copy{ptr};
+  }
+  EXPECT_EQ(0, state.deleter_count);
+  EXPECT_FALSE(queue.empty());
+  EXPECT_EQ(1u, queue.drain());
+  EXPECT_EQ(1, state.deleter_count);
+  EXPECT_TRUE(queue.empty());
+}
+
+TEST(deferred_deleter, weakOutlivesObject)
+{
+  test_state state;
+  experimental::reclamation_queue queue;
+  weak_ptr<tracked> w;
+  {
+    shared_ptr<tracked> ptr{new tracked{1, &state}, experimental::defer_deletion<tracked>(queue)};
+    w = ptr;
+  }
+  EXPECT_TRUE(w.expired());
+  EXPECT_EQ(nullptr, w.lock().get());
+  EXPECT_EQ(1u, queue.drain());
+  EXPECT_EQ(1, state.deleter_count);
+  EXPECT_TRUE(w.expired());
+}
+
+TEST(deferred_deleter, customDeleter)
+{
+  test_state state;
+  experimental::reclamation_queue queue;
+  {
+    experimental::local_shared_ptr<A> ptr{new A, experimental::defer_deletion(test_deleter<A>{&state}, queue)};
+  }
+  EXPECT_EQ(0, state.deleter_count);
+  queue.drain();
+  EXPECT_EQ(1, state.deleter_count);
+}
+
+TEST(deferred_deleter, reclaimerThread)
+{
+  std::atomic<int> destroyed{0};
+  experimental::reclamation_queue queue;
+  {
+    experimental::reclaimer_thread reclaimer{queue, std::chrono::microseconds{100}};
+    for(int i = 0; i < 100; ++i) {
+      shared_ptr<concurrent_tracked> ptr{new concurrent_tracked{i, &destroyed},
+                                         experimental::defer_deletion<concurrent_tracked>(queue)};
+    }
+  }
+  EXPECT_EQ(100, destroyed);
+  EXPECT_TRUE(queue.empty());
+}
+
+TEST(enable_shared_from_this, constructorPtr)
+{
+  auto p = new self_aware;
+  shared_ptr<self_aware> ptr{p};
+  shared_ptr<self_aware> self = p->shared_from_this();
+  EXPECT_EQ(p, self.get());
+  EXPECT_EQ(2, ptr.use_count());
+  EXPECT_EQ(p, p->weak_from_this().lock().get());
+}
+
+TEST(enable_shared_from_this, constructorUniquePtr)
+{
+  std::unique_ptr<self_aware> u{new self_aware};
+  self_aware* p = u.get();
+  shared_ptr<self_aware> ptr{std::move(u)};
+  EXPECT_EQ(ptr.get(), p->shared_from_this().get());
+}
+
+TEST(enable_shared_from_this, makeShared)
+{
+  auto ptr = experimental::make_shared<self_aware>();
+  const self_aware& ref = *ptr.get();
+  shared_ptr<const self_aware> self = ref.shared_from_this();
+  EXPECT_EQ(ptr.get(), self.get());
+  EXPECT_EQ(2, ptr.use_count());
+}
+
+TEST(enable_shared_from_this, notOwned)
+{
+  self_aware object;
+  EXPECT_THROW(object.shared_from_this(), std::bad_weak_ptr);
+  EXPECT_TRUE(object.weak_from_this().expired());
+}
+
+TEST(enable_shared_from_this, copyDoesNotShareOwner)
+{
+  auto ptr = experimental::make_shared<self_aware>();
+  self_aware copy{*ptr.get()};
+  EXPECT_THROW(copy.shared_from_this(), std::bad_weak_ptr);
+}
+
+TEST(embedded_shared_from_this, constructorPtr)
+{
+  test_state state;
+  {
+    auto p = new embedded{&state};
+    shared_ptr<embedded> ptr{p};
+    EXPECT_EQ(1, ptr.use_count());
+    shared_ptr<embedded> self = p->shared_from_this();
+    EXPECT_EQ(p, self.get());
+    EXPECT_EQ(2, ptr.use_count());
+  }
+  EXPECT_EQ(1, state.deleter_count);
+}
+
+TEST(embedded_shared_from_this, adoptedTwice)
+{
+  test_state state;
+  {
+    auto p = new embedded{&state};
+    shared_ptr<embedded> ptr{p};
+    shared_ptr<embedded> again{p};
+    EXPECT_EQ(2, ptr.use_count());
+  }
+  EXPECT_EQ(1, state.deleter_count);
+}
+
+TEST(embedded_shared_from_this, weakOutlivesObject)
+{
+  test_state state;
+  weak_ptr<embedded> w;
+  {
+    auto p = new embedded{&state};
+    shared_ptr<embedded> ptr{p};
+    w = p->weak_from_this();
+    EXPECT_EQ(p, w.lock().get());
+  }
+  EXPECT_EQ(1, state.deleter_count);
+  EXPECT_TRUE(w.expired());
+  EXPECT_EQ(nullptr, w.lock().get());
+}
+
+TEST(embedded_shared_from_this, makeShared)
+{
+  test_state state;
+  {
+    auto ptr = experimental::make_shared<embedded>(&state);
+    EXPECT_EQ(1, ptr.use_count());
+    shared_ptr<embedded> self = ptr->shared_from_this();
+    EXPECT_EQ(ptr.get(), self.get());
+    EXPECT_EQ(2, ptr.use_count());
+    EXPECT_EQ(ptr.get(), ptr->weak_from_this().lock().get());
+  }
+  EXPECT_EQ(1, state.deleter_count);
+}
+
+TEST(embedded_shared_from_this, constructorPtrDeleter)
+{
+  test_state state;
+  {
+    auto p = new embedded{&state};
+    shared_ptr<embedded> ptr{p, std::default_delete<embedded>{}};
+    EXPECT_EQ(1, ptr.use_count());
+    EXPECT_EQ(p, p->shared_from_this().get());
+    EXPECT_EQ(p, p->weak_from_this().lock().get());
+    shared_ptr<embedded> again{p, std::default_delete<embedded>{}};
+    EXPECT_EQ(2, ptr.use_count());
+  }
+  EXPECT_EQ(1, state.deleter_count);
+}
+
+TEST(embedded_shared_from_this, constructorPtrDeleterAllocator)
+{
+  test_state state;
+  {
+    auto p = new embedded{&state};
+    shared_ptr<embedded> ptr{p, std::default_delete<embedded>{}, std::allocator<embedded>{}};
+    EXPECT_EQ(1, ptr.use_count());
+    EXPECT_EQ(p, p->shared_from_this().get());
+    EXPECT_EQ(p, p->weak_from_this().lock().get());
+  }
+  EXPECT_EQ(1, state.deleter_count);
+}
+
+TEST(embedded_shared_from_this, constructorUniquePtr)
+{
+  test_state state;
+  weak_ptr<embedded> w;
+  {
+    shared_ptr<embedded> ptr{std::unique_ptr<embedded>{new embedded{&state}}};
+    EXPECT_EQ(1, ptr.use_count());
+    shared_ptr<embedded> self = ptr->shared_from_this();
+    EXPECT_EQ(ptr.get(), self.get());
+    EXPECT_EQ(2, ptr.use_count());
+    w = ptr->weak_from_this();
+    EXPECT_FALSE(w.expired());
+  }
+  EXPECT_EQ(1, state.deleter_count);
+  EXPECT_TRUE(w.expired());
+}
+
+TEST(embedded_shared_from_this, makeUniqueShareable)
+{
+  test_state state;
+  {
+    auto unique = experimental::make_unique_shareable<embedded>(&state);
+    shared_ptr<embedded> ptr = std::move(unique).share();
+    EXPECT_EQ(1, ptr.use_count());
+    EXPECT_EQ(ptr.get(), ptr->shared_from_this().get());
+  }
+  EXPECT_EQ(1, state.deleter_count);
+  {
+    auto unique = experimental::make_unique_shareable<embedded>(&state);
+  }
+  EXPECT_EQ(2, state.deleter_count);
+}
+
+TEST(embedded_shared_from_this, sharedWhileUnique)
+{
+  test_state state;
+  auto unique = experimental::make_unique_shareable<embedded>(&state);
+  shared_ptr<embedded> self = unique->shared_from_this();
+  weak_ptr<embedded> w = unique->weak_from_this();
+  EXPECT_EQ(2, self.use_count());
+  unique.reset();
+  EXPECT_EQ(0, state.deleter_count);
+  EXPECT_EQ(1, self.use_count());
+  self = nullptr;
+  EXPECT_EQ(1, state.deleter_count);
+  EXPECT_TRUE(w.expired());
+}
+
+TEST(embedded_shared_from_this, derivedAtOffset)
+{
+  test_state state;
+  weak_ptr<embedded_base> w;
+  {
+    shared_ptr<embedded_base> ptr{new embedded_derived{&state}};
+    w = ptr->weak_from_this();
+    EXPECT_EQ(ptr.get(), ptr->shared_from_this().get());
+  }
+  EXPECT_EQ(1, state.deleter_count);
+  EXPECT_TRUE(w.expired());
+  w.reset();
+  {
+    shared_ptr<embedded_base> ptr = experimental::make_shared<embedded_derived>(&state);
+  }
+  EXPECT_EQ(2, state.deleter_count);
+}
+
+TEST(embedded_shared_from_this, classOperatorDelete)
+{
+  embedded_class_delete::deletes = 0;
+  {
+    shared_ptr<embedded_class_delete> ptr{new embedded_class_delete};
+  }
+  EXPECT_EQ(1, embedded_class_delete::deletes);
+  {
+    shared_ptr<embedded_class_delete> ptr{new embedded_class_delete};
+    weak_ptr<embedded_class_delete> w = ptr->weak_from_this();
+    ptr = nullptr;
+    EXPECT_EQ(1, embedded_class_delete::deletes);
+  }
+  EXPECT_EQ(2, embedded_class_delete::deletes);
+}
+
+TEST(embedded_shared_from_this, notOwned)
+{
+  test_state state;
+  embedded object{&state};
+  EXPECT_THROW(object.shared_from_this(), std::bad_weak_ptr);
+  EXPECT_TRUE(object.weak_from_this().expired());
+}
+
+TEST(intrusive_ref_base, onePointer)
+{
+  static_assert(std::is_same<intrusive_ptr<intrusive_node>,
+                             experimental::shared_ptr<intrusive_node, experimental::intrusive<>>>::value, "");
+  static_assert(std::is_same<decltype(intrusive_node::next), intrusive_ptr<intrusive_node>>::value, "");
+  EXPECT_EQ(sizeof(void*), sizeof(intrusive_ptr<intrusive_node>));
+  EXPECT_EQ(sizeof(void*), sizeof(intrusive_weak_ptr<intrusive_node>));
+  EXPECT_EQ(sizeof(void*), sizeof(intrusive_ptr<opted_in>));
+  // the layout of shared_ptr does not depend on the pointee
+  EXPECT_EQ(2 * sizeof(void*), sizeof(shared_ptr<intrusive_node>));
+}
+
+TEST(intrusive_ref_base, constructorPtr)
+{
+  test_state state;
+  {
+    auto p = new intrusive_node{&state};
+    intrusive_ptr<intrusive_node> ptr{p};
+    EXPECT_EQ(p, ptr.get());
+    EXPECT_EQ(1, ptr.use_count());
+    intrusive_ptr<intrusive_node> again{p};
+    intrusive_ptr<intrusive_node> copy{ptr};
+    EXPECT_EQ(3, ptr.use_count());
+  }
+  EXPECT_EQ(1, state.deleter_count);
+}
+
+TEST(intrusive_ref_base, makeShared)
+{
+  test_state state;
+  {
+    auto ptr = experimental::make_intrusive<intrusive_node>(&state);
+    ptr->next = experimental::make_intrusive<intrusive_node>(&state);
+    intrusive_ptr<intrusive_node> self = ptr->next->shared_from_this();
+    EXPECT_EQ(ptr->next.get(), self.get());
+    EXPECT_EQ(2, self.use_count());
+    auto opted = experimental::make_shared_with<opted_in, experimental::intrusive<>>();
+    EXPECT_EQ(3, opted->value);
+  }
+  EXPECT_EQ(2, state.deleter_count);
+}
+
+TEST(intrusive_ref_base, conversionToBase)
+{
+  test_state state;
+  {
+    intrusive_ptr<intrusive_node> base;
+    {
+      intrusive_ptr<intrusive_leaf> leaf{new intrusive_leaf{&state}};
+      base = leaf;
+      EXPECT_EQ(2, base.use_count());
+    }
+    EXPECT_EQ(2, static_cast<intrusive_leaf*>(base.get())->value);
+  }
+  EXPECT_EQ(1, state.deleter_count);
+}
+
+TEST(intrusive_ref_base, weakOutlivesObject)
+{
+  test_state state;
+  intrusive_weak_ptr<intrusive_node> w;
+  {
+    auto ptr = experimental::make_intrusive<intrusive_node>(&state);
+    w = ptr;
+    EXPECT_EQ(ptr.get(), w.lock().get());
+    EXPECT_EQ(1, w.use_count());
+  }
+  EXPECT_EQ(1, state.deleter_count);
+  EXPECT_TRUE(w.expired());
+  EXPECT_EQ(nullptr, w.lock().get());
+  EXPECT_THROW(intrusive_ptr<intrusive_node>{w}, std::bad_weak_ptr);
+}
+
+TEST(intrusive_ref_base, notOwned)
+{
+  test_state state;
+  intrusive_node object{&state};
+  EXPECT_THROW(object.shared_from_this(), std::bad_weak_ptr);
+  EXPECT_TRUE(object.weak_from_this().expired());
+}
+
+TEST(intrusive_ref_base, constructorUniquePtr)
+{
+  test_state state;
+  {
+    std::unique_ptr<intrusive_leaf> p{new intrusive_leaf{&state}};
+    intrusive_ptr<intrusive_node> ptr{std::move(p)};
+    EXPECT_EQ(nullptr, p.get());
+    EXPECT_EQ(1, ptr.use_count());
+  }
+  EXPECT_EQ(1, state.deleter_count);
+}
+
+TEST(thin_shared_ptr, oneWord)
+{
+  EXPECT_EQ(sizeof(void*), sizeof(experimental::thin_shared_ptr<tracked>));
+  EXPECT_EQ(sizeof(void*), sizeof(experimental::thin_weak_ptr<tracked>));
+}
+
+TEST(thin_shared_ptr, makeThinShared)
+{
+  test_state state;
+  {
+    auto ptr = experimental::make_thin_shared<tracked>(1, &state);
+    EXPECT_EQ(1, ptr->value);
+    auto copy = ptr;
+    EXPECT_EQ(2, ptr.use_count());
+    auto aligned = experimental::make_thin_shared<std::max_align_t>();
+    EXPECT_TRUE(aligned);
+  }
+  EXPECT_EQ(1, state.deleter_count);
+}
+
+TEST(thin_shared_ptr, conversions)
+{
+  test_state state;
+  {
+    auto full = experimental::make_shared_with<tracked, experimental::atomic_counters>(1, &state);
+    experimental::thin_shared_ptr<tracked> thin{full};
+    EXPECT_EQ(full.get(), thin.get());
+    EXPECT_EQ(2, full.use_count());
+    experimental::shared_ptr<tracked, experimental::atomic_counters> back = thin;
+    EXPECT_EQ(full.get(), back.get());
+    EXPECT_EQ(3, full.use_count());
+    experimental::thin_shared_ptr<tracked> moved{std::move(full)};
+    EXPECT_EQ(nullptr, full.get());
+    EXPECT_EQ(3, moved.use_count());
+    back = std::move(moved);
+    EXPECT_FALSE(moved);
+    EXPECT_EQ(2, back.use_count());
+  }
+  EXPECT_EQ(1, state.deleter_count);
+}
+
+TEST(thin_shared_ptr, notRepresentable)
+{
+  test_state state;
+  {
+    experimental::shared_ptr<tracked, experimental::atomic_counters> adopted{new tracked{1, &state}};
+    EXPECT_FALSE(experimental::thin_shared_ptr<tracked>{adopted});
+    auto full = experimental::make_shared_with<tracked, experimental::atomic_counters>(2, &state);
+    experimental::shared_ptr<tracked, experimental::atomic_counters> alias{adopted, full.get()};
+    EXPECT_FALSE(experimental::thin_shared_ptr<tracked>{alias});
+    EXPECT_EQ(1, full.use_count());
+  }
+  EXPECT_EQ(2, state.deleter_count);
+}
+
+TEST(thin_weak_ptr, lock)
+{
+  test_state state;
+  experimental::thin_weak_ptr<tracked> w;
+  {
+    auto ptr = experimental::make_thin_shared<tracked>(1, &state);
+    w = ptr;
+    EXPECT_EQ(ptr.get(), w.lock().get());
+    experimental::weak_ptr<tracked, experimental::atomic_counters> full = w;
+    EXPECT_EQ(ptr.get(), full.lock().get());
+  }
+  EXPECT_EQ(1, state.deleter_count);
+  EXPECT_TRUE(w.expired());
+  EXPECT_FALSE(w.lock());
+}
+
+TEST(unique_shareable_ptr, destroyedUnshared)
+{
+  test_state state;
+  {
+    auto ptr = experimental::make_unique_shareable<tracked>(1, &state);
+    EXPECT_EQ(1, ptr->value);
+    auto moved = std::move(ptr);
+    EXPECT_FALSE(ptr);
+    EXPECT_TRUE(moved);
+  }
+  EXPECT_EQ(1, state.deleter_count);
+}
 
-template <class T1, class T2>
-bool operator==(const test_allocator<T1>& lhs, const test_allocator<T2>& rhs)
+TEST(unique_shareable_ptr, share)
 {
-  return true;
+  test_state state;
+  {
+    auto unique = experimental::make_unique_shareable<tracked>(1, &state);
+    tracked* raw = unique.get();
+    experimental::shared_ptr<tracked, experimental::atomic_counters> shared = std::move(unique);
+    EXPECT_FALSE(unique);
+    EXPECT_EQ(raw, shared.get());
+    EXPECT_EQ(1, shared.use_count());
+    auto copy = shared;
+    EXPECT_EQ(2, shared.use_count());
+    experimental::thin_shared_ptr<tracked> thin{shared};
+    EXPECT_TRUE(thin);
+  }
+  EXPECT_EQ(1, state.deleter_count);
 }
 
-template <class T1, class T2>
-bool operator!=(const test_allocator<T1>& lhs, const test_allocator<T2>& rhs)
+TEST(unique_shareable_ptr, sharedFromThis)
 {
-  return std::rel_ops::operator!=(lhs, rhs);
+  auto unique = experimental::make_unique_shareable<self_aware>();
+  auto shared = std::move(unique).share();
+  auto again = shared->shared_from_this();
+  EXPECT_EQ(shared.get(), again.get());
+  EXPECT_EQ(2, shared.use_count());
 }
+
+TEST(unique_shareable_ptr, localCounters)
+{
+  test_state state;
+  auto unique = experimental::make_unique_shareable<tracked, experimental::local_counters>(1, &state);
+  experimental::local_shared_ptr<tracked> shared = std::move(unique).share();
+  unique = experimental::make_unique_shareable<tracked, experimental::local_counters>(2, &state);
+  unique.reset();
+  EXPECT_EQ(1, state.deleter_count);
+  shared = nullptr;
+  EXPECT_EQ(2, state.deleter_count);
 }
 
+namespace {
 
+int borrowed_value(experimental::borrowed_ptr<tracked> ptr) { return ptr->value; }
 
-TEST(shared_ptr, defaultConstructor)
-{
-  shared_ptr<A> ptr;
-  EXPECT_EQ(0, ptr.use_count());
-  EXPECT_EQ(nullptr, ptr.get());
 }
 
-TEST(shared_ptr, constructorPtr)
+TEST(borrowed_ptr, noReferences)
 {
-  A* p = new A;
-  shared_ptr<A> ptr{p};
+  test_state state;
+  auto ptr = experimental::make_shared<tracked>(1, &state);
+  experimental::borrowed_ptr<tracked> borrowed = ptr;
+  auto copy = borrowed;
+  EXPECT_EQ(1, borrowed_value(ptr));
+  EXPECT_EQ(1, borrowed_value(copy));
   EXPECT_EQ(1, ptr.use_count());
-  EXPECT_EQ(p, ptr.get());
+  EXPECT_EQ(ptr.get(), copy.get());
+  EXPECT_FALSE((std::is_constructible<experimental::borrowed_ptr<tracked>, shared_ptr<tracked>&&>::value));
 }
 
-TEST(shared_ptr, constructorPtrDeleter)
+TEST(borrowed_ptr, retain)
 {
   test_state state;
-  test_deleter<A> deleter{&state};
+  shared_ptr<tracked> kept;
   {
-    A* p = new A;
-    shared_ptr<A> ptr{p, deleter};
-    EXPECT_EQ(1, ptr.use_count());
-    EXPECT_EQ(p, ptr.get());
-    EXPECT_EQ(0, state.deleter_count);
+    auto ptr = experimental::make_shared<tracked>(1, &state);
+    experimental::borrowed_ptr<tracked> borrowed = ptr;
+    kept = borrowed.retain();
+    EXPECT_EQ(2, ptr.use_count());
   }
+  EXPECT_EQ(0, state.deleter_count);
+  kept = nullptr;
   EXPECT_EQ(1, state.deleter_count);
+  EXPECT_FALSE(experimental::borrowed_ptr<tracked>{}.retain());
 }
 
-TEST(shared_ptr, constructorPtrDeleterAllocator)
+TEST(borrowed_ptr, conversions)
+{
+  auto ptr = experimental::make_shared<B>();
+  experimental::borrowed_ptr<B> derived = ptr;
+  experimental::borrowed_ptr<A> base = derived;
+  experimental::borrowed_ptr<A> other = ptr;
+  EXPECT_EQ(base.get(), other.get());
+  shared_ptr<A> retained = base.retain();
+  EXPECT_EQ(2, ptr.use_count());
+}
+
+TEST(borrowed_ptr, intrusiveObjectOwnedBySharedPtr)
 {
   test_state state;
-  test_allocator<A> allocator{&state};
-  test_deleter<A> deleter{&state};
   {
-    A* p = new A;
-    shared_ptr<A> ptr{p, deleter, allocator};
-    EXPECT_EQ(1, ptr.use_count());
-    EXPECT_EQ(p, ptr.get());
-    EXPECT_EQ(0, state.deleter_count);
-    EXPECT_NE(0, state.allocated_bytes);
-    EXPECT_EQ(0, state.deallocated_bytes);
+    shared_ptr<intrusive_node> ptr = experimental::make_shared<intrusive_node>(&state);
+    experimental::borrowed_ptr<intrusive_node> borrowed = ptr;
+    shared_ptr<intrusive_node> retained = borrowed.retain();
+    EXPECT_EQ(2, ptr.use_count());
+    EXPECT_EQ(3, ptr->shared_from_this().use_count());
+    auto unique = experimental::make_unique_shareable<intrusive_node>(&state);
+    EXPECT_EQ(2, unique->shared_from_this().use_count());
   }
-  EXPECT_EQ(1, state.deleter_count);
-  EXPECT_NE(0, state.allocated_bytes);
-  EXPECT_EQ(state.allocated_bytes, state.deallocated_bytes);
-  std::cout << "Allocated size: " << state.allocated_bytes << "\n";
+  EXPECT_EQ(2, state.deleter_count);
 }
 
-TEST(shared_ptr, constructorNullptrDeleter)
+TEST(relocation, trait)
+{
+  EXPECT_TRUE(experimental::is_trivially_relocatable<shared_ptr<A>>::value);
+  EXPECT_TRUE(experimental::is_trivially_relocatable<weak_ptr<A>>::value);
+  EXPECT_TRUE(experimental::is_trivially_relocatable<experimental::local_shared_ptr<A>>::value);
+  EXPECT_TRUE(experimental::is_trivially_relocatable<experimental::thin_shared_ptr<A>>::value);
+  EXPECT_TRUE(experimental::is_trivially_relocatable<int>::value);
+  EXPECT_FALSE(experimental::is_trivially_relocatable<std::vector<int>>::value);
+}
+
+TEST(relocation, growAndErase)
 {
   test_state state;
-  test_deleter<A> deleter{&state};
   {
-    shared_ptr<A> ptr{nullptr, deleter};
-    EXPECT_EQ(1, ptr.use_count());
-    EXPECT_EQ(nullptr, ptr.get());
-    EXPECT_EQ(0, state.deleter_count);
+    auto first = experimental::make_shared<tracked>(1, &state);
+    auto second = experimental::make_shared<tracked>(2, &state);
+    experimental::relocating_vector<shared_ptr<tracked>> ptrs;
+    for(int i = 0; i < 100; ++i) {
+      ptrs.push_back(i % 2 ? first : second);
+    }
+    ptrs.emplace_back(ptrs[0]);
+    EXPECT_EQ(101u, ptrs.size());
+    EXPECT_EQ(51, first.use_count());
+    EXPECT_EQ(52, second.use_count());
+    auto it = ptrs.erase(ptrs.begin() + 10, ptrs.begin() + 30);
+    EXPECT_EQ(81u, ptrs.size());
+    EXPECT_EQ(ptrs.begin() + 10, it);
+    EXPECT_EQ(41, first.use_count());
+    EXPECT_EQ(42, second.use_count());
+    EXPECT_EQ(first.get(), ptrs[11].get());
+    ptrs.erase(ptrs.begin());
+    EXPECT_EQ(first.get(), ptrs[0].get());
+    EXPECT_EQ(41, second.use_count());
+    first = nullptr;
+    auto moved = std::move(ptrs);
+    EXPECT_TRUE(ptrs.empty());
+    ptrs = std::move(moved);
+    ptrs.clear();
+    EXPECT_EQ(1, state.deleter_count);
+    EXPECT_EQ(1, second.use_count());
   }
-  EXPECT_EQ(1, state.deleter_count);
+  EXPECT_EQ(2, state.deleter_count);
 }
 
-TEST(shared_ptr, constructorNullptrDeleterAllocator)
+TEST(relocation, nonTrivial)
+{
+  std::allocator<std::vector<int>> alloc;
+  std::vector<int>* from = alloc.allocate(2);
+  std::vector<int>* to = alloc.allocate(2);
+  ::new(static_cast<void*>(from)) std::vector<int>{1, 2};
+  ::new(static_cast<void*>(from + 1)) std::vector<int>{3};
+  EXPECT_EQ(to + 2, experimental::uninitialized_relocate_n(from, 2, to));
+  EXPECT_EQ(2u, to[0].size());
+  EXPECT_EQ(3, to[1][0]);
+  to[0].~vector();
+  to[1].~vector();
+  alloc.deallocate(from, 2);
+  alloc.deallocate(to, 2);
+}
+
+TEST(shared_snapshot, gracePeriod)
 {
   test_state state;
-  test_allocator<A> allocator{&state};
-  test_deleter<A> deleter{&state};
+  experimental::shared_snapshot<tracked> snapshot{experimental::make_shared<tracked>(1, &state)};
   {
-    shared_ptr<A> ptr{nullptr, deleter, allocator};
-    EXPECT_EQ(1, ptr.use_count());
-    EXPECT_EQ(nullptr, ptr.get());
+    auto guard = snapshot.read();
+    EXPECT_EQ(1, guard->value);
+    snapshot.publish(experimental::make_shared<tracked>(2, &state));
+    EXPECT_EQ(1, guard->value);
+    EXPECT_EQ(2, snapshot.read()->value);
+    EXPECT_EQ(1u, snapshot.retired());
+    EXPECT_EQ(0u, snapshot.reclaim());
     EXPECT_EQ(0, state.deleter_count);
-    EXPECT_NE(0, state.allocated_bytes);
-    EXPECT_EQ(0, state.deallocated_bytes);
   }
+  EXPECT_EQ(1u, snapshot.reclaim());
   EXPECT_EQ(1, state.deleter_count);
-  EXPECT_NE(0, state.allocated_bytes);
-  EXPECT_EQ(state.allocated_bytes, state.deallocated_bytes);
-  std::cout << "Allocated size: " << state.allocated_bytes << "\n";
+  EXPECT_EQ(0u, snapshot.retired());
 }
 
-TEST(shared_ptr, constructorAliasing)
+TEST(shared_snapshot, retain)
 {
-  shared_ptr<B> p1{new B};
-  shared_ptr<B> p2{p1};
-  int val;
-  shared_ptr<int> ptr(p1, &val);
-  EXPECT_EQ(&val, ptr.get());
-  EXPECT_EQ(p1.use_count(), ptr.use_count());
+  test_state state;
+  {
+    experimental::shared_snapshot<tracked> snapshot{experimental::make_shared<tracked>(1, &state)};
+    auto kept = snapshot.read().retain();
+    snapshot.publish(experimental::make_shared<tracked>(2, &state));
+    snapshot.synchronize();
+    EXPECT_EQ(0, state.deleter_count);
+    EXPECT_EQ(1, kept->value);
+    EXPECT_EQ(1, kept.use_count());
+    kept = nullptr;
+    EXPECT_EQ(1, state.deleter_count);
+    EXPECT_EQ(2, snapshot.load()->value);
+  }
+  EXPECT_EQ(2, state.deleter_count);
 }
 
-TEST(shared_ptr, constructorAliasingNull)
+TEST(shared_snapshot, nestedReads)
 {
-  shared_ptr<B> p1{new B};
-  shared_ptr<B> p2{p1};
-  shared_ptr<A> ptr(p1, nullptr);
-  EXPECT_EQ(nullptr, ptr.get());
-  EXPECT_FALSE(ptr);
-  EXPECT_EQ(p1.use_count(), ptr.use_count());
+  experimental::shared_snapshot<int, experimental::atomic_counters, 2> snapshot{experimental::make_shared<int>(1)};
+  auto outer = snapshot.read();
+  auto inner = snapshot.read();
+  EXPECT_EQ(outer.get(), inner.get());
 }
 
-TEST(shared_ptr, constructorAliasingEmpty)
+TEST(shared_snapshot, concurrentReaders)
 {
-  shared_ptr<B> p1;
-  int val;
-  shared_ptr<int> ptr(p1, &val);
-  EXPECT_EQ(&val, ptr.get());
-  EXPECT_TRUE(static_cast<bool>(ptr));
-  EXPECT_EQ(0, p1.use_count());
-  EXPECT_EQ(p1.use_count(), ptr.use_count());
+  std::atomic<int> destroyed{0};
+  std::atomic<bool> done{false};
+  {
+    experimental::shared_snapshot<concurrent_tracked> snapshot{
+        experimental::make_shared<concurrent_tracked>(0, &destroyed)};
+    std::vector<std::thread> readers;
+    for(int i = 0; i < 4; ++i) {
+      readers.emplace_back([&] {
+        int last = 0;
+        while(!done.load()) {
+          auto guard = snapshot.read();
+          EXPECT_LE(last, guard->value);
+          last = guard->value;
+        }
+      });
+    }
+    for(int i = 1; i <= 1000; ++i) {
+      snapshot.publish(experimental::make_shared<concurrent_tracked>(i, &destroyed));
+    }
+    done = true;
+    for(auto& t : readers) {
+      t.join();
+    }
+    snapshot.synchronize();
+    EXPECT_EQ(1000, destroyed.load());
+  }
+  EXPECT_EQ(1001, destroyed.load());
 }
 
-// add tests for copy-construction/assignment to aliasing ptr
+TEST(batch, shareN)
+{
+  test_state state;
+  {
+    auto ptr = experimental::make_shared<tracked>(1, &state);
+    std::vector<shared_ptr<tracked>> copies;
+    experimental::share_n(ptr, 5, std::back_inserter(copies));
+    ASSERT_EQ(5u, copies.size());
+    EXPECT_EQ(6, ptr.use_count());
+    EXPECT_EQ(ptr.get(), copies.back().get());
+    auto fixed = experimental::share_n<3>(ptr);
+    EXPECT_EQ(9, ptr.use_count());
+    EXPECT_EQ(ptr.get(), fixed[2].get());
+  }
+  EXPECT_EQ(1, state.deleter_count);
+}
 
-TEST(shared_ptr, copyConstructor)
+TEST(batch, shareNEmpty)
 {
-  shared_ptr<A> p{new A};
-  shared_ptr<A> ptr{p};
-  EXPECT_EQ(p.get(), ptr.get());
-  EXPECT_EQ(p.use_count(), ptr.use_count());
-  EXPECT_EQ(2, ptr.use_count());
+  shared_ptr<A> empty;
+  auto copies = experimental::share_n<2>(empty);
+  EXPECT_EQ(nullptr, copies[1].get());
+  EXPECT_EQ(0, copies[1].use_count());
 }
 
-TEST(shared_ptr, copyConstructorEmpty)
+TEST(batch, releaseN)
 {
-  shared_ptr<A> p;
-  shared_ptr<A> ptr{p};
-  EXPECT_EQ(p.get(), ptr.get());
-  EXPECT_EQ(p.use_count(), ptr.use_count());
-  EXPECT_EQ(0, ptr.use_count());
+  test_state state;
+  auto first = experimental::make_shared<tracked>(1, &state);
+  auto second = experimental::make_shared<tracked>(2, &state);
+  std::vector<shared_ptr<tracked>> ptrs;
+  experimental::share_n(first, 3, std::back_inserter(ptrs));
+  ptrs.emplace_back();
+  experimental::share_n(second, 2, std::back_inserter(ptrs));
+  experimental::share_n(first, 1, std::back_inserter(ptrs));
+  first = nullptr;
+  experimental::release_n(ptrs.begin(), ptrs.begin() + 4);
+  EXPECT_EQ(0, state.deleter_count);
+  EXPECT_EQ(nullptr, ptrs[0].get());
+  EXPECT_EQ(3, second.use_count());
+  experimental::release_n(ptrs.begin(), ptrs.end());
+  EXPECT_EQ(1, state.deleter_count);
+  EXPECT_EQ(1, second.use_count());
 }
 
-TEST(shared_ptr, copyConstructorOtherType)
+TEST(batch, releaseNLocal)
 {
-  shared_ptr<B> p{new B};
-  shared_ptr<A> ptr{p};
-  EXPECT_EQ(p.get(), ptr.get());
-  EXPECT_EQ(p.use_count(), ptr.use_count());
-  EXPECT_EQ(2, ptr.use_count());
+  test_state state;
+  auto ptr = experimental::make_shared_with<tracked, experimental::local_counters>(1, &state);
+  auto copies = experimental::share_n<4>(ptr);
+  EXPECT_EQ(5, ptr.use_count());
+  ptr = nullptr;
+  experimental::release_n(copies.begin(), copies.end());
+  EXPECT_EQ(1, state.deleter_count);
 }
 
-TEST(shared_ptr, copyConstructorOtherTypeEmpty)
+TEST(batch, releaseAll)
 {
-  shared_ptr<B> p;
-  shared_ptr<A> ptr{p};
-  EXPECT_EQ(p.get(), ptr.get());
-  EXPECT_EQ(p.use_count(), ptr.use_count());
-  EXPECT_EQ(0, ptr.use_count());
+  test_state state;
+  auto first = experimental::make_shared<tracked>(1, &state);
+  auto second = experimental::make_shared<tracked>(2, &state);
+  std::vector<shared_ptr<tracked>> ptrs{first, second, first, shared_ptr<tracked>{}, second, first};
+  first = nullptr;
+  experimental::release_all(ptrs.begin(), ptrs.end());
+  EXPECT_EQ(1, state.deleter_count);
+  EXPECT_EQ(1, second.use_count());
+  for(const auto& ptr : ptrs) {
+    EXPECT_EQ(nullptr, ptr.get());
+  }
 }
 
-TEST(shared_ptr, moveConstructor)
+TEST(batch, releaseAllManyBlocks)
 {
-  A* p1 = new A;
-  shared_ptr<A> p{p1};
-  shared_ptr<A> ptr{std::move(p)};
-  EXPECT_EQ(p1, ptr.get());
-  EXPECT_EQ(nullptr, p.get());
-  EXPECT_EQ(0, p.use_count());
-  EXPECT_FALSE(p);
-  EXPECT_EQ(1, ptr.use_count());
+  test_state state;
+  std::vector<shared_ptr<tracked>> owners;
+  for(int i = 0; i < 20; ++i) {
+    owners.push_back(experimental::make_shared<tracked>(i, &state));
+  }
+  std::vector<shared_ptr<tracked>> ptrs;
+  for(int i = 0; i < 100; ++i) {
+    ptrs.push_back(owners[(i * 7) % owners.size()]);
+  }
+  owners.clear();
+  EXPECT_EQ(0, state.deleter_count);
+  experimental::release_all(ptrs.begin(), ptrs.end());
+  EXPECT_EQ(20, state.deleter_count);
 }
 
-TEST(shared_ptr, moveConstructorEmpty)
+TEST(pool_allocator, reusesFreedBlock)
 {
-  shared_ptr<A> p;
-  shared_ptr<A> ptr{std::move(p)};
-  EXPECT_EQ(nullptr, ptr.get());
-  EXPECT_EQ(nullptr, p.get());
-  EXPECT_EQ(0, p.use_count());
-  EXPECT_FALSE(p);
-  EXPECT_EQ(0, ptr.use_count());
+  experimental::pool_allocator<std::int64_t> alloc;
+  std::int64_t* p = alloc.allocate(3);
+  alloc.deallocate(p, 3);
+  std::int64_t* q = alloc.allocate(4);
+  EXPECT_EQ(p, q);
+  alloc.deallocate(q, 4);
 }
 
-TEST(shared_ptr, moveConstructorOtherType)
+TEST(pool_allocator, smallestBlocksReturnedByOtherThread)
 {
-  B* p1 = new B;
-  shared_ptr<B> p{p1};
-  shared_ptr<A> ptr{std::move(p)};
-  EXPECT_EQ(p1, ptr.get());
-  EXPECT_EQ(nullptr, p.get());
-  EXPECT_EQ(0, p.use_count());
-  EXPECT_FALSE(p);
-  EXPECT_EQ(1, ptr.use_count());
+  const std::size_t count = 4 * experimental::detail::block_pool::batch_size;
+  experimental::pool_allocator<std::int64_t> alloc;
+  std::vector<std::int64_t*> blocks;
+  for(std::size_t i = 0; i < count; ++i) {
+    blocks.push_back(alloc.allocate(1));
+  }
+  std::thread{[&] {
+    for(std::int64_t* p : blocks) {
+      alloc.deallocate(p, 1);
+    }
+  }}.join();
+  // blocks left in the cache of this thread are handed out before the returned batches
+  std::unordered_set<std::int64_t*> freed(blocks.begin(), blocks.end());
+  blocks.clear();
+  for(std::size_t i = 0; i < count + 2 * experimental::detail::block_pool::batch_size; ++i) {
+    blocks.push_back(alloc.allocate(1));
+    freed.erase(blocks.back());
+  }
+  EXPECT_TRUE(freed.empty());
+  for(std::int64_t* p : blocks) {
+    alloc.deallocate(p, 1);
+  }
 }
 
-TEST(shared_ptr, moveConstructorOtherTypeEmpty)
+struct allocates_on_exit {
+  std::vector<std::int64_t*>* blocks = nullptr;
+  int value = 0;
+
+  ~allocates_on_exit()
+  {
+    experimental::pool_allocator<std::int64_t> alloc;
+    for(std::size_t i = 0; i < experimental::detail::block_pool::batch_size; ++i) {
+      blocks->push_back(alloc.allocate(1));
+    }
+    value = *experimental::allocate_shared<int>(experimental::pool_allocator<int>{}, 42);
+  }
+};
+
+TEST(pool_allocator, allocateDuringThreadExit)
 {
-  shared_ptr<B> p;
-  shared_ptr<A> ptr{std::move(p)};
-  EXPECT_EQ(p.get(), ptr.get());
-  EXPECT_EQ(nullptr, p.get());
-  EXPECT_EQ(0, p.use_count());
-  EXPECT_FALSE(p);
-  EXPECT_EQ(0, ptr.use_count());
+  const std::size_t batch_size = experimental::detail::block_pool::batch_size;
+  std::vector<std::int64_t*> blocks;
+  std::thread{[&] {
+    // constructed before the cache of the pool so destroyed after it
+    static thread_local allocates_on_exit helper;
+    helper.blocks = &blocks;
+    experimental::pool_allocator<std::int64_t> alloc;
+    alloc.deallocate(alloc.allocate(1), 1);
+  }}.join();
+  ASSERT_EQ(batch_size, blocks.size());
+
+  // blocks handed out during the thread exit are not handed out again
+  experimental::pool_allocator<std::int64_t> alloc;
+  std::unordered_set<std::int64_t*> unique(blocks.begin(), blocks.end());
+  for(std::size_t i = 0; i < 4 * batch_size; ++i) {
+    blocks.push_back(alloc.allocate(1));
+    EXPECT_TRUE(unique.insert(blocks.back()).second);
+  }
+  for(std::int64_t* p : blocks) {
+    alloc.deallocate(p, 1);
+  }
 }
 
-TEST(shared_ptr, constructorFromWeak)
+TEST(pool_allocator, constructorPtrDeleterAllocator)
 {
-  shared_ptr<B> p1{new B};
-  experimental::weak_ptr<B> p2{p1};
-  shared_ptr<A> ptr{p2};
-  EXPECT_EQ(p2.use_count(), ptr.use_count());
-  EXPECT_EQ(2, ptr.use_count());
+  test_state state;
+  {
+    shared_ptr<tracked> ptr{new tracked{1, &state}, std::default_delete<tracked>{},
+                            experimental::pool_allocator<tracked>{}};
+    shared_ptr<tracked> copy{ptr};
+    weak_ptr<tracked> w{ptr};
+    EXPECT_EQ(2, ptr.use_count());
+    EXPECT_EQ(1, copy.get()->value);
+  }
+  EXPECT_EQ(1, state.deleter_count);
 }
 
+TEST(pool_allocator, crossThreadRelease)
+{
+  std::atomic<int> destroyed{0};
+  const int count = 10 * experimental::detail::block_pool::batch_size;
+  std::vector<experimental::shared_ptr<concurrent_tracked>> ptrs;
+  for(int i = 0; i < count; ++i) {
+    ptrs.emplace_back(new concurrent_tracked{i, &destroyed}, std::default_delete<concurrent_tracked>{},
+                      experimental::pool_allocator<concurrent_tracked>{});
+  }
+  std::thread{[&] { ptrs.clear(); }}.join();
+  EXPECT_EQ(count, destroyed);
+  for(int i = 0; i < count; ++i) {
+    ptrs.emplace_back(new concurrent_tracked{i, &destroyed}, std::default_delete<concurrent_tracked>{},
+                      experimental::pool_allocator<concurrent_tracked>{});
+  }
+  ptrs.clear();
+  EXPECT_EQ(2 * count, destroyed);
+}
 
 
 
@@ -306,6 +1805,87 @@ TEST(weak_ptr, defaultConstructor)
   EXPECT_EQ(0, w.use_count());
 }
 
+TEST(weak_ptr, lock)
+{
+  shared_ptr<A> s{new A};
+  weak_ptr<A> w{s};
+  EXPECT_FALSE(w.expired());
+  shared_ptr<A> locked = w.lock();
+  EXPECT_EQ(s.get(), locked.get());
+  EXPECT_EQ(2, s.use_count());
+}
+
+TEST(weak_ptr, lockExpired)
+{
+  test_state state;
+  test_deleter<A> deleter{&state};
+  weak_ptr<A> w;
+  {
+    shared_ptr<A> s{new A, deleter};
+    w = s;
+  }
+  EXPECT_TRUE(w.expired());
+  shared_ptr<A> locked = w.lock();
+  EXPECT_EQ(nullptr, locked.get());
+  EXPECT_EQ(0, locked.use_count());
+  EXPECT_EQ(1, state.deleter_count);
+}
+
+TEST(weak_ptr, lockAndDropWhileReleasing)
+{
+  for(int i = 0; i < 2000; ++i) {
+    std::atomic<int> destroyed{0};
+    shared_ptr<concurrent_tracked> s = experimental::make_shared<concurrent_tracked>(i, &destroyed);
+    weak_ptr<concurrent_tracked> w{s};
+    std::atomic<bool> start{false};
+    std::thread locker{[&] {
+      while(!start) {
+      }
+      shared_ptr<concurrent_tracked> locked = w.lock();
+      w.reset();
+      if(locked) {
+        EXPECT_EQ(0, destroyed.load());
+        EXPECT_EQ(i, locked->value);
+      }
+    }};
+    start = true;
+    s = nullptr;
+    locker.join();
+    EXPECT_EQ(1, destroyed.load());
+  }
+}
+
+TEST(weak_ptr, lockWhileReleasing)
+{
+  for(int i = 0; i < 100; ++i) {
+    std::atomic<int> destroyed{0};
+    shared_ptr<concurrent_tracked> s = experimental::make_shared<concurrent_tracked>(i, &destroyed);
+    weak_ptr<concurrent_tracked> w{s};
+    std::atomic<bool> start{false};
+    std::vector<std::thread> threads;
+    for(int t = 0; t < 4; ++t) {
+      threads.emplace_back([&] {
+        while(!start) {
+        }
+        for(int n = 0; n < 1000; ++n) {
+          shared_ptr<concurrent_tracked> locked = w.lock();
+          if(locked) {
+            EXPECT_EQ(0, destroyed.load());
+            EXPECT_EQ(i, locked.get()->value);
+          }
+        }
+      });
+    }
+    start = true;
+    s = nullptr;
+    for(auto& t : threads) {
+      t.join();
+    }
+    EXPECT_TRUE(w.expired());
+    EXPECT_EQ(1, destroyed.load());
+  }
+}
+
 TEST(weak_ptr, copyConstructorEmpty)
 {
   weak_ptr<A> w1;
@@ -663,3 +2243,71 @@ TEST(weak_ptr, moveAssignmentEmptyToNotEmptyConvertible)
 
 // test EBO (final/notfinal/empty/notempty deleter/allocator)
 // test for copying/moving state with different deleter/allocator types
+
+TEST(weak_ptr, swapAndReset)
+{
+  shared_ptr<A> s1{new A}, s2{new A};
+  weak_ptr<A> w1{s1}, w2{s2};
+  w1.swap(w2);
+  EXPECT_EQ(s2.get(), w1.lock().get());
+  swap(w1, w2);
+  EXPECT_EQ(s1.get(), w1.lock().get());
+  w1.reset();
+  EXPECT_TRUE(w1.expired());
+  EXPECT_EQ(1, s1.use_count());
+}
+
+TEST(owner, ownerBefore)
+{
+  auto s1 = experimental::make_shared<B>();
+  shared_ptr<A> alias{s1, nullptr};
+  shared_ptr<A> s2{new A};
+  weak_ptr<A> w1{s1};
+  EXPECT_FALSE(s1.owner_before(alias));
+  EXPECT_FALSE(alias.owner_before(s1));
+  EXPECT_FALSE(w1.owner_before(s1));
+  EXPECT_NE(s1.owner_before(s2), s2.owner_before(s1));
+  EXPECT_EQ(w1.owner_before(s2), s1.owner_before(s2));
+  EXPECT_FALSE(shared_ptr<A>{}.owner_before(weak_ptr<A>{}));
+}
+
+TEST(owner, hash)
+{
+  auto ptr = experimental::make_shared<A>();
+  EXPECT_EQ(std::hash<A*>{}(ptr.get()), experimental::hash<shared_ptr<A>>{}(ptr));
+  std::unordered_set<shared_ptr<A>> set{ptr};
+  EXPECT_EQ(1u, set.count(ptr));
+}
+
+TEST(owner, ownerHashAndEqual)
+{
+  test_state state;
+  std::unordered_map<weak_ptr<tracked>, int, experimental::owner_hash, experimental::owner_equal> cache;
+  auto first = experimental::make_shared<tracked>(1, &state);
+  auto second = experimental::make_shared<tracked>(2, &state);
+  cache[first] = 1;
+  cache[second] = 2;
+  cache[first] = 3;
+  EXPECT_EQ(2u, cache.size());
+  EXPECT_EQ(3, cache.at(first));
+  EXPECT_TRUE(experimental::owner_equal{}(first, weak_ptr<tracked>{first}));
+  EXPECT_FALSE(experimental::owner_equal{}(first, second));
+  EXPECT_EQ(experimental::owner_hash{}(first), experimental::owner_hash{}(weak_ptr<tracked>{first}));
+
+  weak_ptr<tracked> expired{second};
+  second = nullptr;
+  EXPECT_EQ(1, state.deleter_count);
+  EXPECT_EQ(2, cache.at(expired));
+}
+
+TEST(owner, intrusive)
+{
+  test_state state;
+  auto leaf = experimental::make_intrusive<intrusive_leaf>(&state);
+  intrusive_ptr<intrusive_node> node = leaf;
+  intrusive_weak_ptr<intrusive_node> weak = leaf;
+  EXPECT_TRUE(leaf.owner_equal(node));
+  EXPECT_TRUE(weak.owner_equal(leaf));
+  EXPECT_EQ(leaf.owner_hash(), weak.owner_hash());
+  EXPECT_FALSE(leaf.owner_before(weak));
+}